@@ -49,6 +49,21 @@ proc toSeq*[T](s: SharedSeq[T]): seq[T] =
     ret.add(s.data[i])
   return ret
 
+template asOpenArray*[T](s: SharedSeq[T]): untyped =
+  ## Borrows the content of a SharedSeq[T] without copying it. The SharedSeq
+  ## must stay allocated while the result is used.
+  s.data.toOpenArray(0, s.len - 1)
+
+proc allocSharedBuffer*(size: int): pointer {.nimcall, gcsafe, raises: [].} =
+  ## Allocates a result buffer handed over to the library user, who releases
+  ## it with SdsFreeBuffer.
+  allocShared(size)
+
+proc freeSharedBuffer*(data: pointer) {.nimcall, gcsafe, raises: [].} =
+  ## Releases a buffer from ``allocSharedBuffer``.
+  if not data.isNil():
+    deallocShared(data)
+
 proc allocSharedSeqFromCArray*[T](arr: ptr T, len: int): SharedSeq[T] =
   ## Creates a SharedSeq[T] from a C array pointer and length.
   ## The data is copied to shared memory.
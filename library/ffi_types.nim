@@ -12,6 +12,13 @@ type SdsRetrievalHintProvider* = proc(
 const RET_OK*: cint = 0
 const RET_ERR*: cint = 1
 const RET_MISSING_CALLBACK*: cint = 2
+const RET_BUSY*: cint = 3
+
+const SDS_EXECUTION_THREAD*: cint = 0
+const SDS_EXECUTION_INLINE*: cint = 1
+
+const SDS_BORROW_INPUT*: cuint = 1
+const SDS_TRANSFER_RESULT*: cuint = 2
 
 ### End of exported types
 ################################################################################
@@ -19,14 +26,21 @@ const RET_MISSING_CALLBACK*: cint = 2
 ################################################################################
 ### FFI utils
 
+var runningInline* {.threadvar.}: bool
+  ## Set while a request of an inline context runs on the caller's thread,
+  ## whose GC must not be torn down by the callbacks
+
 template foreignThreadGc*(body: untyped) =
+  let foreignGc = not runningInline
   when declared(setupForeignThreadGc):
-    setupForeignThreadGc()
+    if foreignGc:
+      setupForeignThreadGc()
 
   body
 
   when declared(tearDownForeignThreadGc):
-    tearDownForeignThreadGc()
+    if foreignGc:
+      tearDownForeignThreadGc()
 
 type onDone* = proc()
 
@@ -13,6 +13,22 @@
 #define RET_OK                0
 #define RET_ERR               1
 #define RET_MISSING_CALLBACK  2
+// The request queue is full: the request was dropped and its callback will
+// not be called. The call can be retried later.
+#define RET_BUSY              3
+
+// Execution modes of SdsNewReliabilityManagerWithMode
+#define SDS_EXECUTION_THREAD  0
+#define SDS_EXECUTION_INLINE  1
+
+// Buffer ownership flags of the *WithFlags functions
+// The message is read in place instead of being copied: the caller keeps it
+// alive and unchanged until the callback fires.
+#define SDS_BORROW_INPUT      1
+// On success the callback receives a buffer that the caller owns from then
+// on, and must release with SdsFreeBuffer, instead of one that is only valid
+// during the callback.
+#define SDS_TRANSFER_RESULT   2
 
 #ifdef __cplusplus
 extern "C" {
@@ -28,10 +44,24 @@ typedef void (*SdsRetrievalHintProvider) (const char* messageId, char** hint, si
 
 void* SdsNewReliabilityManager(SdsCallBack callback, void* userData);
 
+// SDS_EXECUTION_THREAD behaves as SdsNewReliabilityManager: requests are
+// queued to a dedicated thread. With SDS_EXECUTION_INLINE, requests run on
+// the calling thread and their callback (as well as any event callback)
+// fires before the call returns. Inline contexts must only be used from the
+// thread that created them, and calls made on a context from one of its own
+// callbacks fail with RET_ERR. They are driven by SdsTick instead of
+// SdsStartPeriodicTasks.
+void* SdsNewReliabilityManagerWithMode(int mode, SdsCallBack callback, void* userData);
+
 void SdsSetEventCallback(void* ctx, SdsCallBack callback, void* userData);
 
 void SdsSetRetrievalHintProvider(void* ctx, SdsRetrievalHintProvider callback, void* userData);
 
+// Resets ctx and blocks until it has answered every request queued so far,
+// after which ctx must not be used. On RET_BUSY nothing was done and ctx is
+// still usable. Must not be called from a callback or event callback of a
+// context running on its own thread, where it fails with RET_ERR and does
+// nothing.
 int SdsCleanupReliabilityManager(void* ctx, SdsCallBack callback, void* userData);
 
 int SdsResetReliabilityManager(void* ctx, SdsCallBack callback, void* userData);
@@ -44,12 +74,61 @@ int SdsWrapOutgoingMessage(void* ctx,
                     SdsCallBack callback,
                     void* userData);
 
+// Same as SdsWrapOutgoingMessage, but on success the callback receives the
+// wrapped message as raw protobuf bytes: `msg` points to `len` bytes, which
+// are only valid for the duration of the callback.
+int SdsWrapOutgoingMessageBytes(void* ctx,
+                    void* message,
+                    size_t messageLen,
+                    const char* messageId,
+                    const char* channelId,
+                    SdsCallBack callback,
+                    void* userData);
+
 int SdsUnwrapReceivedMessage(void* ctx, 
                     void* message, 
                     size_t messageLen, 
                     SdsCallBack callback, 
                     void* userData);
 
+// Same as SdsUnwrapReceivedMessage, but on success the callback receives a
+// binary response instead of JSON. Every section is prefixed by its length
+// as a little-endian uint32_t:
+//
+//   [len][content] [len][channelId] [count]
+//   count x ( [len][missing dependency messageId] [len][retrievalHint] )
+//
+// The content section holds the decoded message bytes as they are, so it can
+// be read in place. The response is only valid for the duration of the
+// callback.
+int SdsUnwrapReceivedMessageBytes(void* ctx,
+                    void* message,
+                    size_t messageLen,
+                    SdsCallBack callback,
+                    void* userData);
+
+// Same as SdsWrapOutgoingMessageBytes and SdsUnwrapReceivedMessageBytes, with
+// the buffer ownership given by `flags`, a combination of SDS_BORROW_INPUT
+// and SDS_TRANSFER_RESULT.
+int SdsWrapOutgoingMessageWithFlags(void* ctx,
+                    void* message,
+                    size_t messageLen,
+                    const char* messageId,
+                    const char* channelId,
+                    uint32_t flags,
+                    SdsCallBack callback,
+                    void* userData);
+
+int SdsUnwrapReceivedMessageWithFlags(void* ctx,
+                    void* message,
+                    size_t messageLen,
+                    uint32_t flags,
+                    SdsCallBack callback,
+                    void* userData);
+
+// Releases a result received with SDS_TRANSFER_RESULT.
+void SdsFreeBuffer(void* buffer);
+
 int SdsMarkDependenciesMet(void* ctx, 
                     char** messageIDs, 
                     size_t count, 
@@ -59,6 +138,11 @@ int SdsMarkDependenciesMet(void* ctx,
 
 int SdsStartPeriodicTasks(void* ctx, SdsCallBack callback, void* userData);
 
+// Runs the periodic work that is due (resends, expiries and the periodic sync
+// event). On success `msg` holds the number of
+// milliseconds, in decimal, until the next call is due.
+int SdsTick(void* ctx, SdsCallBack callback, void* userData);
+
 
 
 #ifdef __cplusplus
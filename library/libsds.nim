@@ -73,6 +73,12 @@ proc acquireCtx(callback: SdsCallBack, userData: pointer): ptr SdsContext =
       return nil
 
 proc releaseCtx(ctx: ptr SdsContext) =
+  if ctx.isInline():
+    # Inline contexts have no thread worth keeping around
+    sds_thread.destroySdsThread(ctx).isOkOr:
+      error "failed to destroy inline context", error = error
+    return
+
   ctxPoolLock.acquire()
   defer: ctxPoolLock.release()
   ctx.userData = nil
@@ -87,8 +93,17 @@ proc handleRequest(
     callback: SdsCallBack,
     userData: pointer,
 ): cint =
+  if ctx.isInline():
+    sds_thread.processRequestInline(ctx, requestType, content, callback, userData).isOkOr:
+      let msg = "libsds error: " & $error
+      callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
+      return RET_ERR
+    return RET_OK
+
   sds_thread.sendRequestToSdsThread(ctx, requestType, content, callback, userData).isOkOr:
-    let msg = "libsds error: " & $error
+    if error.code == RET_BUSY:
+      return RET_BUSY
+    let msg = "libsds error: " & error.msg
     callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
     return RET_ERR
 
@@ -133,6 +148,73 @@ proc onRetrievalHint(ctx: ptr SdsContext): RetrievalHintProvider =
     
     return @[]
 
+proc sendWrapRequest(
+    ctx: ptr SdsContext,
+    op: SdsMessageMsgType,
+    message: pointer,
+    messageLen: csize_t,
+    messageId: cstring,
+    channelId: cstring,
+    callback: SdsCallBack,
+    userData: pointer,
+    flags: cuint = 0,
+): cint =
+  checkLibsdsParams(ctx, callback, userData)
+
+  if message == nil and messageLen > 0:
+    let msg = "libsds error: " & "message pointer is NULL but length > 0"
+    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
+    return RET_ERR
+
+  if messageId == nil:
+    let msg = "libsds error: " & "message ID pointer is NULL"
+    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
+    return RET_ERR
+
+  if channelId == nil:
+    let msg = "libsds error: " & "channel ID pointer is NULL"
+    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
+    return RET_ERR
+
+  if channelId != nil and $channelId == "":
+    let msg = "libsds error: " & "channel ID is empty string"
+    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
+    return RET_ERR
+
+  handleRequest(
+    ctx,
+    RequestType.MESSAGE,
+    SdsMessageRequest.createShared(
+      op, message, messageLen, messageId, channelId, flags
+    ),
+    callback,
+    userData,
+  )
+
+proc sendUnwrapRequest(
+    ctx: ptr SdsContext,
+    op: SdsMessageMsgType,
+    message: pointer,
+    messageLen: csize_t,
+    callback: SdsCallBack,
+    userData: pointer,
+    flags: cuint = 0,
+): cint =
+  checkLibsdsParams(ctx, callback, userData)
+
+  if message == nil and messageLen > 0:
+    let msg = "libsds error: " & "message pointer is NULL but length > 0"
+    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
+    return RET_ERR
+
+  handleRequest(
+    ctx,
+    RequestType.MESSAGE,
+    SdsMessageRequest.createShared(op, message, messageLen, flags = flags),
+    callback,
+    userData,
+  )
+
 ### End of not-exported components
 ################################################################################
 
@@ -173,18 +255,28 @@ proc initializeLibrary() {.exported.} =
 ################################################################################
 ### Exported procs
 
-proc SdsNewReliabilityManager(
-    callback: SdsCallBack, userData: pointer
-): pointer {.dynlib, exportc, cdecl.} =
-  initializeLibrary()
-
-  ## Creates a new instance of the Reliability Manager.
+proc newReliabilityManager(
+    mode: cint, callback: SdsCallBack, userData: pointer
+): pointer =
   if isNil(callback):
     echo "error: missing callback in NewReliabilityManager"
     return nil
 
-  ## Create or reuse the SDS thread that will keep waiting for req from the main thread.
-  var ctx = acquireCtx(callback, userData)
+  var ctx: ptr SdsContext
+  case mode
+  of SDS_EXECUTION_THREAD:
+    ## Create or reuse the SDS thread that will keep waiting for req from the main thread.
+    ctx = acquireCtx(callback, userData)
+  of SDS_EXECUTION_INLINE:
+    ctx = sds_thread.createSdsInlineContext().valueOr:
+      let msg = "Error in createSdsInlineContext: " & $error
+      callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
+      return nil
+  else:
+    let msg = "libsds error: unknown execution mode " & $mode
+    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
+    return nil
+
   if ctx.isNil():
     return nil
 
@@ -208,11 +300,30 @@ proc SdsNewReliabilityManager(
     userData,
   )
 
-  if retCode == RET_ERR:
+  if retCode != RET_OK:
+    releaseCtx(ctx)
     return nil
 
   return ctx
 
+proc SdsNewReliabilityManager(
+    callback: SdsCallBack, userData: pointer
+): pointer {.dynlib, exportc, cdecl.} =
+  initializeLibrary()
+
+  ## Creates a new instance of the Reliability Manager.
+  newReliabilityManager(SDS_EXECUTION_THREAD, callback, userData)
+
+proc SdsNewReliabilityManagerWithMode(
+    mode: cint, callback: SdsCallBack, userData: pointer
+): pointer {.dynlib, exportc, cdecl.} =
+  initializeLibrary()
+
+  ## Creates a new instance of the Reliability Manager, which runs requests on
+  ## its own thread (SDS_EXECUTION_THREAD) or on the calling thread
+  ## (SDS_EXECUTION_INLINE).
+  newReliabilityManager(mode, callback, userData)
+
 proc SdsSetEventCallback(
     ctx: ptr SdsContext, callback: SdsCallBack, userData: pointer
 ) {.dynlib, exportc.} =
@@ -233,6 +344,13 @@ proc SdsCleanupReliabilityManager(
   initializeLibrary()
   checkLibsdsParams(ctx, callback, userData)
 
+  # The requests of a callback stay in flight until it returns, so waiting for
+  # them from there would never end
+  if sds_thread.isSdsThread():
+    let msg = "libsds error: cleanup called from an sds thread callback"
+    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
+    return RET_ERR
+
   let resetRes = handleRequest(
     ctx,
     RequestType.LIFECYCLE,
@@ -241,7 +359,13 @@ proc SdsCleanupReliabilityManager(
     userData,
   )
 
-  if resetRes == RET_ERR:
+  if resetRes != RET_OK:
+    return resetRes
+
+  # The reset and the requests queued before it must be answered before the
+  # context can be handed to its next owner
+  sds_thread.waitIdle(ctx).isOkOr:
+    error "context not released, requests still pending", error = error
     return RET_ERR
 
   releaseCtx(ctx)
@@ -272,63 +396,93 @@ proc SdsWrapOutgoingMessage(
     userData: pointer,
 ): cint {.dynlib, exportc.} =
   initializeLibrary()
-  checkLibsdsParams(ctx, callback, userData)
-
-  if message == nil and messageLen > 0:
-    let msg = "libsds error: " & "message pointer is NULL but length > 0"
-    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
-    return RET_ERR
-
-  if messageId == nil:
-    let msg = "libsds error: " & "message ID pointer is NULL"
-    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
-    return RET_ERR
+  sendWrapRequest(
+    ctx, SdsMessageMsgType.WRAP_MESSAGE, message, messageLen, messageId, channelId,
+    callback, userData,
+  )
 
-  if channelId == nil:
-    let msg = "libsds error: " & "channel ID pointer is NULL"
-    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
-    return RET_ERR
+proc SdsWrapOutgoingMessageBytes(
+    ctx: ptr SdsContext,
+    message: pointer,
+    messageLen: csize_t,
+    messageId: cstring,
+    channelId: cstring,
+    callback: SdsCallBack,
+    userData: pointer,
+): cint {.dynlib, exportc.} =
+  ## Same as SdsWrapOutgoingMessage, but the callback receives the wrapped
+  ## message as raw bytes instead of a comma-separated list of decimals.
+  initializeLibrary()
+  sendWrapRequest(
+    ctx, SdsMessageMsgType.WRAP_MESSAGE_BYTES, message, messageLen, messageId,
+    channelId, callback, userData,
+  )
 
-  if channelId != nil and $channelId == "":
-    let msg = "libsds error: " & "channel ID is empty string"
-    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
-    return RET_ERR
+proc SdsUnwrapReceivedMessage(
+    ctx: ptr SdsContext,
+    message: pointer,
+    messageLen: csize_t,
+    callback: SdsCallBack,
+    userData: pointer,
+): cint {.dynlib, exportc.} =
+  initializeLibrary()
+  sendUnwrapRequest(
+    ctx, SdsMessageMsgType.UNWRAP_MESSAGE, message, messageLen, callback, userData
+  )
 
-  handleRequest(
-    ctx,
-    RequestType.MESSAGE,
-    SdsMessageRequest.createShared(
-      SdsMessageMsgType.WRAP_MESSAGE, message, messageLen, messageId, channelId
-    ),
-    callback,
+proc SdsUnwrapReceivedMessageBytes(
+    ctx: ptr SdsContext,
+    message: pointer,
+    messageLen: csize_t,
+    callback: SdsCallBack,
+    userData: pointer,
+): cint {.dynlib, exportc.} =
+  ## Same as SdsUnwrapReceivedMessage, but the callback receives the binary
+  ## layout described in libsds.h instead of JSON.
+  initializeLibrary()
+  sendUnwrapRequest(
+    ctx, SdsMessageMsgType.UNWRAP_MESSAGE_BYTES, message, messageLen, callback,
     userData,
   )
 
-proc SdsUnwrapReceivedMessage(
+proc SdsWrapOutgoingMessageWithFlags(
     ctx: ptr SdsContext,
     message: pointer,
     messageLen: csize_t,
+    messageId: cstring,
+    channelId: cstring,
+    flags: cuint,
     callback: SdsCallBack,
     userData: pointer,
 ): cint {.dynlib, exportc.} =
+  ## Same as SdsWrapOutgoingMessageBytes, with the buffer ownership given by
+  ## ``flags`` (SDS_BORROW_INPUT, SDS_TRANSFER_RESULT).
   initializeLibrary()
-  checkLibsdsParams(ctx, callback, userData)
-
-  if message == nil and messageLen > 0:
-    let msg = "libsds error: " & "message pointer is NULL but length > 0"
-    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
-    return RET_ERR
+  sendWrapRequest(
+    ctx, SdsMessageMsgType.WRAP_MESSAGE_BYTES, message, messageLen, messageId,
+    channelId, callback, userData, flags,
+  )
 
-  handleRequest(
-    ctx,
-    RequestType.MESSAGE,
-    SdsMessageRequest.createShared(
-      SdsMessageMsgType.UNWRAP_MESSAGE, message, messageLen
-    ),
-    callback,
-    userData,
+proc SdsUnwrapReceivedMessageWithFlags(
+    ctx: ptr SdsContext,
+    message: pointer,
+    messageLen: csize_t,
+    flags: cuint,
+    callback: SdsCallBack,
+    userData: pointer,
+): cint {.dynlib, exportc.} =
+  ## Same as SdsUnwrapReceivedMessageBytes, with the buffer ownership given by
+  ## ``flags`` (SDS_BORROW_INPUT, SDS_TRANSFER_RESULT).
+  initializeLibrary()
+  sendUnwrapRequest(
+    ctx, SdsMessageMsgType.UNWRAP_MESSAGE_BYTES, message, messageLen, callback,
+    userData, flags,
   )
 
+proc SdsFreeBuffer(buffer: pointer) {.dynlib, exportc.} =
+  ## Releases a result handed over with SDS_TRANSFER_RESULT.
+  freeSharedBuffer(buffer)
+
 proc SdsMarkDependenciesMet(
     ctx: ptr SdsContext,
     messageIds: pointer,
@@ -370,6 +524,12 @@ proc SdsStartPeriodicTasks(
 ): cint {.dynlib, exportc.} =
   initializeLibrary()
   checkLibsdsParams(ctx, callback, userData)
+
+  if ctx.isInline():
+    # Nothing would run the tasks between requests
+    let msg = "libsds error: " & "inline contexts are driven by SdsTick"
+    callback(RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), userData)
+    return RET_ERR
   handleRequest(
     ctx,
     RequestType.LIFECYCLE,
@@ -378,5 +538,18 @@ proc SdsStartPeriodicTasks(
     userData,
   )
 
+proc SdsTick(
+    ctx: ptr SdsContext, callback: SdsCallBack, userData: pointer
+): cint {.dynlib, exportc.} =
+  initializeLibrary()
+  checkLibsdsParams(ctx, callback, userData)
+  handleRequest(
+    ctx,
+    RequestType.LIFECYCLE,
+    SdsLifecycleRequest.createShared(SdsLifecycleMsgType.TICK),
+    callback,
+    userData,
+  )
+
 ### End of exported procs
 ################################################################################
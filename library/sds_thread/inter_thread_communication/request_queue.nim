@@ -0,0 +1,64 @@
+## Bounded multi-producer, single-consumer queue used to hand requests to the
+## SDS Thread.
+##
+## This is Dmitry Vyukov's bounded queue: every cell carries a sequence number
+## telling whether it is free for the producer at a given position or holds a
+## value for the consumer. Producers claim positions with a CAS on the enqueue
+## position and never wait on each other or on the consumer; a full queue is
+## reported instead. The consumer side must only be used by one thread.
+
+import std/atomics
+
+const CacheLineSize = 64
+
+type
+  Cell[T] = object
+    sequence: Atomic[int]
+    value: T
+
+  RequestQueue*[T; N: static int] = object
+    ## ``N`` must be a power of two. The queue may live in shared memory and
+    ## must be initialized with ``init`` before use.
+    # Producers and the consumer write to different cache lines
+    enqueuePos: Atomic[int]
+    pad0: array[CacheLineSize - sizeof(int), byte]
+    dequeuePos: int
+    pad1: array[CacheLineSize - sizeof(int), byte]
+    cells: array[N, Cell[T]]
+
+proc init*[T; N: static int](queue: var RequestQueue[T, N]) =
+  static:
+    doAssert N > 0 and (N and (N - 1)) == 0, "capacity must be a power of two"
+  for i in 0 ..< N:
+    queue.cells[i].sequence.store(i, moRelaxed)
+  queue.enqueuePos.store(0, moRelaxed)
+  queue.dequeuePos = 0
+
+proc trySend*[T; N: static int](queue: var RequestQueue[T, N], value: T): bool =
+  ## Enqueues ``value`` from any thread. Returns false if the queue is full.
+  var pos = queue.enqueuePos.load(moRelaxed)
+  while true:
+    let cell = addr queue.cells[pos and (N - 1)]
+    let dif = cell.sequence.load(moAcquire) - pos
+    if dif == 0:
+      if queue.enqueuePos.compareExchangeWeak(pos, pos + 1, moRelaxed, moRelaxed):
+        cell.value = value
+        cell.sequence.store(pos + 1, moRelease)
+        return true
+      # ``pos`` was reloaded by the failed CAS
+    elif dif < 0:
+      return false
+    else:
+      pos = queue.enqueuePos.load(moRelaxed)
+
+proc tryRecv*[T; N: static int](queue: var RequestQueue[T, N], value: var T): bool =
+  ## Dequeues the oldest value. Must only be called from the consumer thread.
+  ## Returns false if the queue is empty.
+  let pos = queue.dequeuePos
+  let cell = addr queue.cells[pos and (N - 1)]
+  if cell.sequence.load(moAcquire) - (pos + 1) < 0:
+    return false
+  value = cell.value
+  cell.sequence.store(pos + N, moRelease)
+  queue.dequeuePos = pos + 1
+  true
@@ -27,7 +27,7 @@ proc createShared*(
   ret[].messageIds = allocSharedSeqFromCArray(cast[ptr cstring](messageIds), count.int)
   return ret
 
-proc destroyShared(self: ptr SdsDependenciesRequest) =
+proc destroyShared*(self: ptr SdsDependenciesRequest) =
   deallocSharedSeq(self[].messageIds)
   deallocShared(self[].channelId)
   deallocShared(self)
@@ -1,4 +1,4 @@
-import std/json
+import std/[json, times]
 import chronos, chronicles, results
 
 import library/alloc
@@ -8,6 +8,7 @@ type SdsLifecycleMsgType* = enum
   CREATE_RELIABILITY_MANAGER
   RESET_RELIABILITY_MANAGER
   START_PERIODIC_TASKS
+  TICK
 
 type SdsLifecycleRequest* = object
   operation: SdsLifecycleMsgType
@@ -26,7 +27,7 @@ proc createShared*(
   ret[].channelId = channelId.alloc()
   return ret
 
-proc destroyShared(self: ptr SdsLifecycleRequest) =
+proc destroyShared*(self: ptr SdsLifecycleRequest) =
   deallocShared(self[].channelId)
   deallocShared(self)
 
@@ -62,5 +63,8 @@ proc process*(
       return err("error processing RESET_RELIABILITY_MANAGER request: " & $error)
   of START_PERIODIC_TASKS:
     rm[].startPeriodicTasks()
+  of TICK:
+    # returns the milliseconds until the next tick is due
+    return ok($rm[].tick().inMilliseconds)
 
   return ok("")
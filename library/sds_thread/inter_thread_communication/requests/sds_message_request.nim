@@ -1,12 +1,14 @@
 import std/[json, strutils, net, sequtils, base64]
 import chronos, chronicles, results
 
-import library/alloc
+import library/[alloc, ffi_types]
 import sds
 
 type SdsMessageMsgType* = enum
   WRAP_MESSAGE
+  WRAP_MESSAGE_BYTES
   UNWRAP_MESSAGE
+  UNWRAP_MESSAGE_BYTES
 
 type SdsMessageRequest* = object
   operation: SdsMessageMsgType
@@ -14,6 +16,8 @@ type SdsMessageRequest* = object
   messageLen: csize_t
   messageId: cstring
   channelId: cstring
+  borrowed: bool # ``message`` is the caller's buffer, not a copy
+  transferResult: bool
 
 type SdsUnwrapResponse* = object
   message*: seq[byte]
@@ -27,22 +31,101 @@ proc createShared*(
     messageLen: csize_t = 0,
     messageId: cstring = "",
     channelId: cstring = "",
+    flags: cuint = 0,
 ): ptr type T =
   var ret = createShared(T)
   ret[].operation = op
   ret[].messageLen = messageLen
   ret[].messageId = messageId.alloc()
   ret[].channelId = channelId.alloc()
-  ret[].message = allocSharedSeqFromCArray(cast[ptr byte](message), messageLen.int)
+  ret[].borrowed = (flags and SDS_BORROW_INPUT) != 0
+  ret[].transferResult = (flags and SDS_TRANSFER_RESULT) != 0
+  if ret[].borrowed:
+    # The caller keeps the message alive until the callback fires
+    ret[].message = (cast[ptr UncheckedArray[byte]](message), messageLen.int)
+  else:
+    ret[].message = allocSharedSeqFromCArray(cast[ptr byte](message), messageLen.int)
 
   return ret
 
-proc destroyShared(self: ptr SdsMessageRequest) =
-  deallocSharedSeq(self[].message)
+proc destroyShared*(self: ptr SdsMessageRequest) =
+  if not self[].borrowed:
+    deallocSharedSeq(self[].message)
   deallocShared(self[].messageId)
   deallocShared(self[].channelId)
   deallocShared(self)
 
+proc writeUint32(buf: var openArray[byte], pos: var int, value: uint32) =
+  ## Writes ``value`` as a little-endian uint32.
+  for i in 0 ..< 4:
+    buf[pos + i] = byte((value shr (8 * i)) and 0xff)
+  pos += 4
+
+proc writeSection(buf: var openArray[byte], pos: var int, data: openArray[byte]) =
+  ## Writes ``data`` prefixed by its length.
+  buf.writeUint32(pos, uint32(data.len))
+  if data.len > 0:
+    copyMem(addr buf[pos], unsafeAddr data[0], data.len)
+    pos += data.len
+
+proc writeSection(buf: var openArray[byte], pos: var int, data: string) =
+  buf.writeSection(pos, data.toOpenArrayByte(0, data.high))
+
+proc binarySize(res: SdsUnwrapResponse): int =
+  result = 4 + res.message.len + 4 + res.channelId.len + 4
+  for dep in res.missingDeps:
+    result += 4 + dep.messageId.len + 4 + dep.retrievalHint.len
+
+proc writeBinary(res: SdsUnwrapResponse, buf: var openArray[byte]) =
+  ## Encodes ``res`` in the layout documented for
+  ## SdsUnwrapReceivedMessageBytes in libsds.h: content, channel ID and the
+  ## count of missing dependencies, followed by the ID and retrieval hint of
+  ## each dependency, every section prefixed by its length. ``buf`` must hold
+  ## ``binarySize`` bytes.
+  var pos = 0
+  buf.writeSection(pos, res.message)
+  buf.writeSection(pos, res.channelId)
+  buf.writeUint32(pos, uint32(res.missingDeps.len))
+  for dep in res.missingDeps:
+    buf.writeSection(pos, dep.messageId)
+    buf.writeSection(pos, dep.retrievalHint)
+
+proc toBinary(res: SdsUnwrapResponse): string =
+  result = newString(res.binarySize())
+  res.writeBinary(result.toOpenArrayByte(0, result.high))
+
+proc transfersResult*(self: ptr SdsMessageRequest): bool =
+  ## Whether the result is handed over by ``processTransfer``.
+  self.transferResult
+
+proc processTransfer*(
+    self: ptr SdsMessageRequest, rm: ptr ReliabilityManager
+): Future[Result[SharedSeq[byte], string]] {.async.} =
+  ## Processes a binary request whose result is written to a buffer from
+  ## ``allocShared`` and handed over to the caller, who frees it with
+  ## SdsFreeBuffer.
+  defer:
+    destroyShared(self)
+
+  case self.operation
+  of WRAP_MESSAGE, WRAP_MESSAGE_BYTES:
+    var wrapped = AllocatedBuffer(alloc: allocSharedBuffer, release: freeSharedBuffer)
+    wrapOutgoingMessage(
+      rm[], self.message.asOpenArray(), $self.messageId, $self.channelId, wrapped
+    ).isOkOr:
+      error "WRAP_MESSAGE failed", error = error
+      return err("error processing WRAP_MESSAGE request: " & $error)
+    return ok((wrapped.data, wrapped.len))
+  of UNWRAP_MESSAGE, UNWRAP_MESSAGE_BYTES:
+    let (unwrappedMessage, missingDeps, extractedChannelId) = unwrapReceivedMessage(rm[], self.message.asOpenArray()).valueOr:
+      return err("error processing UNWRAP_MESSAGE request: " & $error)
+
+    let res = SdsUnwrapResponse(message: unwrappedMessage, missingDeps: missingDeps, channelId: extractedChannelId)
+    let size = res.binarySize()
+    let data = cast[ptr UncheckedArray[byte]](allocSharedBuffer(size))
+    res.writeBinary(data.toOpenArray(0, size - 1))
+    return ok((data, size))
+
 proc process*(
     self: ptr SdsMessageRequest, rm: ptr ReliabilityManager
 ): Future[Result[string, string]] {.async.} =
@@ -50,23 +133,35 @@ proc process*(
     destroyShared(self)
 
   case self.operation
+  of WRAP_MESSAGE_BYTES:
+    # returns the wrapped bytes as they are, serialized into the response
+    var res: string
+    wrapOutgoingMessage(
+      rm[], self.message.asOpenArray(), $self.messageId, $self.channelId, res
+    ).isOkOr:
+      error "WRAP_MESSAGE failed", error = error
+      return err("error processing WRAP_MESSAGE request: " & $error)
+    return ok(res)
   of WRAP_MESSAGE:
-    let messageBytes = self.message.toSeq()
-
-    let wrappedMessage = wrapOutgoingMessage(rm[], messageBytes, $self.messageId, $self.channelId).valueOr:
+    var wrappedMessage: seq[byte]
+    wrapOutgoingMessage(
+      rm[], self.message.asOpenArray(), $self.messageId, $self.channelId,
+      wrappedMessage,
+    ).isOkOr:
       error "WRAP_MESSAGE failed", error = error
       return err("error processing WRAP_MESSAGE request: " & $error)
 
     # returns a comma-separates string of bytes
     return ok(wrappedMessage.mapIt($it).join(","))
-  of UNWRAP_MESSAGE:
-    let messageBytes = self.message.toSeq()
-
-    let (unwrappedMessage, missingDeps, extractedChannelId) = unwrapReceivedMessage(rm[], messageBytes).valueOr:
+  of UNWRAP_MESSAGE, UNWRAP_MESSAGE_BYTES:
+    let (unwrappedMessage, missingDeps, extractedChannelId) = unwrapReceivedMessage(rm[], self.message.asOpenArray()).valueOr:
       return err("error processing UNWRAP_MESSAGE request: " & $error)
 
     let res = SdsUnwrapResponse(message: unwrappedMessage, missingDeps: missingDeps, channelId: extractedChannelId)
 
+    if self.operation == UNWRAP_MESSAGE_BYTES:
+      return ok(res.toBinary())
+
     # return the result as a json string
     var node = newJObject()
     node["message"] = %*res.message
@@ -5,7 +5,7 @@
 import std/json, results
 import chronos, chronos/threadsync
 import
-  ../../ffi_types,
+  ../../[alloc, ffi_types],
   ./requests/[sds_lifecycle_request, sds_message_request, sds_dependencies_request],
   sds/sds_utils
 
@@ -34,11 +34,32 @@ proc createShared*(
   ret[].userData = userData
   return ret
 
-proc handleRes[T: string | void](
+proc destroyShared*(request: ptr SdsThreadRequest) =
+  ## Frees a request that will not be processed, together with its content.
+  case request[].reqType
+  of LIFECYCLE:
+    destroyShared(cast[ptr SdsLifecycleRequest](request[].reqContent))
+  of MESSAGE:
+    destroyShared(cast[ptr SdsMessageRequest](request[].reqContent))
+  of DEPENDENCIES:
+    destroyShared(cast[ptr SdsDependenciesRequest](request[].reqContent))
+  deallocShared(request)
+
+proc reject*(request: ptr SdsThreadRequest, reason: string) =
+  ## Answers a request that will not be processed with an error, and frees it.
+  foreignThreadGc:
+    let msg = "libsds error: " & reason
+    request[].callback(
+      RET_ERR, unsafeAddr msg[0], cast[csize_t](len(msg)), request[].userData
+    )
+  destroyShared(request)
+
+proc handleRes[T: string | void | SharedSeq[byte]](
     res: Result[T, string], request: ptr SdsThreadRequest
 ) =
-  ## Handles the Result responses, which can either be Result[string, string] or
-  ## Result[void, string].
+  ## Handles the Result responses, which can either be Result[string, string],
+  ## Result[void, string] or, for results handed over to the caller,
+  ## Result[SharedSeq[byte], string].
 
   defer:
     deallocShared(request)
@@ -51,18 +72,34 @@ proc handleRes[T: string | void](
       )
     return
 
+  when T is SharedSeq[byte]:
+    foreignThreadGc:
+      let buf = res.get()
+      request[].callback(
+        RET_OK, cast[ptr cchar](buf.data), cast[csize_t](buf.len), request[].userData
+      )
+    return
+
   foreignThreadGc:
-    var msg: cstring = ""
+    var msg = ""
     when T is string:
-      msg = res.get().cstring()
+      msg = res.get()
+    # The length comes from the string and not from a NUL terminator, as
+    # results may be binary
     request[].callback(
-      RET_OK, unsafeAddr msg[0], cast[csize_t](len(msg)), request[].userData
+      RET_OK, cast[ptr cchar](msg.cstring), cast[csize_t](msg.len), request[].userData
     )
   return
 
 proc process*(
     T: type SdsThreadRequest, request: ptr SdsThreadRequest, rm: ptr ReliabilityManager
 ) {.async.} =
+  if request[].reqType == MESSAGE:
+    let content = cast[ptr SdsMessageRequest](request[].reqContent)
+    if content.transfersResult():
+      handleRes(await content.processTransfer(rm), request)
+      return
+
   let retFut =
     case request[].reqType
     of LIFECYCLE:
@@ -3,26 +3,61 @@
 {.passc: "-fPIC".}
 
 import std/[options, atomics, os, net, locks]
-import chronicles, chronos, chronos/threadsync, taskpools/channels_spsc_single, results
+import chronicles, chronos, chronos/threadsync, results
 import
   ../ffi_types,
-  ./inter_thread_communication/sds_thread_request,
+  ./inter_thread_communication/[request_queue, sds_thread_request],
   sds/sds_utils
 
-type SdsContext* = object
-  thread: Thread[(ptr SdsContext)]
-  lock: Lock
-  reqChannel: ChannelSPSCSingle[ptr SdsThreadRequest]
-  reqSignal: ThreadSignalPtr
-    # to inform The SDS Thread (a.k.a TST) that a new request is sent
-  reqReceivedSignal: ThreadSignalPtr
-    # to inform the main thread that the request is rx by TST
-  userData*: pointer
-  eventCallback*: pointer
-  eventUserdata*: pointer
-  retrievalHintProvider*: pointer
-  retrievalHintUserData*: pointer
-  running: Atomic[bool] # To control when the thread is running
+const RequestQueueCapacity* = 1024
+  ## Requests that can be waiting for the SDS Thread before submissions are
+  ## rejected with RET_BUSY.
+
+type
+  SdsContext* = object
+    thread: Thread[(ptr SdsContext)]
+    lock: Lock
+    reqQueue: RequestQueue[ptr SdsThreadRequest, RequestQueueCapacity]
+    reqSignal: ThreadSignalPtr
+      # to inform The SDS Thread (a.k.a TST) that new requests are queued
+    wakeupPending: Atomic[bool]
+      # set while reqSignal has been fired and TST has not started draining yet,
+      # so that a batch of requests only fires it once
+    inFlight: Atomic[int] # requests queued and not yet answered
+    idleSignal: ThreadSignalPtr # fired by TST when ``inFlight`` drops to zero
+    userData*: pointer
+    eventCallback*: pointer
+    eventUserdata*: pointer
+    retrievalHintProvider*: pointer
+    retrievalHintUserData*: pointer
+    running: Atomic[bool] # To control when the thread is running
+    inline: bool
+      # requests run on the thread that created the context instead of on TST
+    inlineRm: ReliabilityManager # manager of an inline context
+    inlineBusy: bool # set while an inline context runs a request
+
+  SendRequestError* = object
+    code*: cint ## RET_ERR, or RET_BUSY when the queue is full
+    msg*: string
+
+var onSdsThread {.threadvar.}: bool
+  ## Set on every SDS Thread, where all the callbacks of its context run
+
+proc isSdsThread*(): bool =
+  ## Whether the calling thread is an SDS Thread, i.e. runs a callback.
+  onSdsThread
+
+proc requestDone(ctx: ptr SdsContext) =
+  if ctx.inFlight.fetchSub(1) == 1:
+    discard ctx.idleSignal.fireSync()
+
+proc processQueued(
+    ctx: ptr SdsContext, request: ptr SdsThreadRequest, rm: ptr ReliabilityManager
+) {.async.} =
+  try:
+    await SdsThreadRequest.process(request, rm)
+  finally:
+    ctx.requestDone()
 
 proc runSds(ctx: ptr SdsContext) {.async.} =
   ## This is the worker body. This runs the SDS instance
@@ -34,24 +69,27 @@ proc runSds(ctx: ptr SdsContext) {.async.} =
     await ctx.reqSignal.wait()
 
     if ctx.running.load == false:
+      # Requests queued meanwhile are answered with an error, and those
+      # already started are let finish
+      var request: ptr SdsThreadRequest
+      while ctx.reqQueue.tryRecv(request):
+        request.reject("the sds thread is stopping")
+        ctx.requestDone()
+      while ctx.inFlight.load() > 0:
+        await sleepAsync(chronos.milliseconds(1))
       break
 
-    ## Trying to get a request from the libsds requestor thread
-    var request: ptr SdsThreadRequest
-    let recvOk = ctx.reqChannel.tryRecv(request)
-    if not recvOk:
-      error "sds thread could not receive a request"
-      continue
-
-    ## Handle the request
-    asyncSpawn SdsThreadRequest.process(request, addr rm)
+    # Cleared before draining: requests queued from now on fire a new wakeup
+    ctx.wakeupPending.store(false)
 
-    let fireRes = ctx.reqReceivedSignal.fireSync()
-    if fireRes.isErr():
-      error "could not fireSync back to requester thread", error = fireRes.error
+    ## Handle every request queued since the last wakeup
+    var request: ptr SdsThreadRequest
+    while ctx.reqQueue.tryRecv(request):
+      asyncSpawn ctx.processQueued(request, addr rm)
 
 proc run(ctx: ptr SdsContext) {.thread.} =
   ## Launch sds worker
+  onSdsThread = true
   waitFor runSds(ctx)
 
 proc createSdsThread*(): Result[ptr SdsContext, string] =
@@ -60,8 +98,10 @@ proc createSdsThread*(): Result[ptr SdsContext, string] =
   var ctx = createShared(SdsContext, 1)
   ctx.reqSignal = ThreadSignalPtr.new().valueOr:
     return err("couldn't create reqSignal ThreadSignalPtr")
-  ctx.reqReceivedSignal = ThreadSignalPtr.new().valueOr:
-    return err("couldn't create reqReceivedSignal ThreadSignalPtr")
+  ctx.idleSignal = ThreadSignalPtr.new().valueOr:
+    discard ctx.reqSignal.close()
+    return err("couldn't create idleSignal ThreadSignalPtr")
+  ctx.reqQueue.init()
   ctx.lock.initLock()
 
   ctx.running.store(true)
@@ -76,7 +116,25 @@ proc createSdsThread*(): Result[ptr SdsContext, string] =
 
   return ok(ctx)
 
+proc createSdsInlineContext*(): Result[ptr SdsContext, string] =
+  ## Creates a context without a thread: its requests are run by
+  ## ``processRequestInline`` on the calling thread. The context must only be
+  ## used from the thread creating it, whose heap holds its manager.
+  var ctx = createShared(SdsContext, 1)
+  ctx.inline = true
+  ctx.lock.initLock()
+  return ok(ctx)
+
+proc isInline*(ctx: ptr SdsContext): bool =
+  ctx.inline
+
 proc destroySdsThread*(ctx: ptr SdsContext): Result[void, string] =
+  if ctx.inline:
+    ctx.inlineRm = nil
+    ctx.lock.deinitLock()
+    freeShared(ctx)
+    return ok()
+
   ctx.running.store(false)
 
   let signaledOnTime = ctx.reqSignal.fireSync().valueOr:
@@ -87,7 +145,7 @@ proc destroySdsThread*(ctx: ptr SdsContext): Result[void, string] =
   joinThread(ctx.thread)
   ctx.lock.deinitLock()
   ?ctx.reqSignal.close()
-  ?ctx.reqReceivedSignal.close()
+  ?ctx.idleSignal.close()
   freeShared(ctx)
 
   return ok()
@@ -98,37 +156,70 @@ proc sendRequestToSdsThread*(
     reqContent: pointer,
     callback: SdsCallBack,
     userData: pointer,
-): Result[void, string] =
+): Result[void, SendRequestError] =
+  ## Queues a request for the SDS Thread without waiting for it to be picked
+  ## up. Can be called from any thread. On error the request is freed and its
+  ## callback will not be called.
   let req = SdsThreadRequest.createShared(reqType, reqContent, callback, userData)
 
-  # This lock is only necessary while we use a SP Channel and while the signalling
-  # between threads assumes that there aren't concurrent requests.
-  # Rearchitecting the signaling + migrating to a MP Channel will allow us to receive
-  # requests concurrently and spare us the need of locks
-  ctx.lock.acquire()
-  defer:
-    ctx.lock.release()
-  ## Sending the request
-  let sentOk = ctx.reqChannel.trySend(req)
-  if not sentOk:
-    deallocShared(req)
-    return err("Couldn't send a request to the sds thread: " & $req[])
-
-  let fireSyncRes = ctx.reqSignal.fireSync()
-  if fireSyncRes.isErr():
-    deallocShared(req)
-    return err("failed fireSync: " & $fireSyncRes.error)
-
-  if fireSyncRes.get() == false:
-    deallocShared(req)
-    return err("Couldn't fireSync in time")
-
-  ## wait until the SDS Thread properly received the request
-  let res = ctx.reqReceivedSignal.waitSync()
-  if res.isErr():
-    deallocShared(req)
-    return err("Couldn't receive reqReceivedSignal signal")
+  # Counted before it is queued, so that TST cannot answer it first
+  discard ctx.inFlight.fetchAdd(1)
+  if not ctx.reqQueue.trySend(req):
+    ctx.requestDone()
+    destroyShared(req)
+    return err(SendRequestError(code: RET_BUSY, msg: "the sds thread queue is full"))
+
+  ## Only the first request of a batch wakes up the SDS Thread
+  if not ctx.wakeupPending.exchange(true):
+    let fireSyncRes = ctx.reqSignal.fireSync()
+    if fireSyncRes.isErr() or fireSyncRes.get() == false:
+      # The request is already queued and will be handled on the next wakeup,
+      # which the next request will try to fire again
+      ctx.wakeupPending.store(false)
+      error "could not signal the sds thread",
+        error = (if fireSyncRes.isErr(): fireSyncRes.error else: "timeout")
 
   ## Notice that in case of "ok", the deallocShared(req) is performed by the SDS Thread in the
   ## process proc.
   ok()
+
+proc waitIdle*(ctx: ptr SdsContext): Result[void, string] =
+  ## Blocks until every request queued so far has been answered, so that no
+  ## callback or event of theirs fires afterwards. Fails on an SDS Thread,
+  ## which would wait for the request it runs.
+  if ctx.inline:
+    return ok()
+  if onSdsThread:
+    return err("cannot wait for the sds thread from one of its callbacks")
+  while ctx.inFlight.load() > 0:
+    discard ctx.idleSignal.waitSync().valueOr:
+      return err("failed to wait for the sds thread: " & $error)
+  ok()
+
+proc processRequestInline*(
+    ctx: ptr SdsContext,
+    reqType: RequestType,
+    reqContent: pointer,
+    callback: SdsCallBack,
+    userData: pointer,
+): Result[void, string] =
+  ## Runs a request of an inline context to completion on the calling thread;
+  ## its callback is called before returning. Requests made from a callback of
+  ## the same context are refused, as the manager is in the middle of one.
+  let req = SdsThreadRequest.createShared(reqType, reqContent, callback, userData)
+  if ctx.inlineBusy:
+    destroyShared(req)
+    return err("inline context called back from one of its callbacks")
+
+  let outerInline = runningInline # callbacks may use another inline context
+  ctx.inlineBusy = true
+  runningInline = true
+  defer:
+    ctx.inlineBusy = false
+    runningInline = outerInline
+  try:
+    waitFor SdsThreadRequest.process(req, addr ctx.inlineRm)
+  except CatchableError:
+    return err("failed to process request inline: " & getCurrentExceptionMsg())
+
+  ok()
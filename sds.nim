@@ -1,8 +1,22 @@
 import std/[times, locks, tables, sets, options]
 import chronos, results, chronicles
-import sds/[message, protobuf, sds_utils, rolling_bloom_filter]
+import sds/[message, message_view, protobuf, sds_utils, bloom, rolling_bloom_filter]
 
-export message, protobuf, sds_utils, rolling_bloom_filter
+export message, message_view, protobuf, sds_utils, bloom, rolling_bloom_filter
+
+type
+  ChannelEventKind {.pure.} = enum
+    MessageReady
+    MessageSent
+    MissingDependencies
+
+  ChannelEvent = object
+    ## Callback due for a channel. Events are collected while the channel lock
+    ## is held and fired once it is released, so that callbacks may call back
+    ## into the manager for the same channel.
+    kind: ChannelEventKind
+    messageId: SdsMessageID
+    missingDeps: seq[HistoryEntry]
 
 proc newReliabilityManager*(
     config: ReliabilityConfig = defaultConfig()
@@ -16,9 +30,12 @@ proc newReliabilityManager*(
   ##   A Result containing either a new ReliabilityManager instance or an error.
   try:
     let rm = ReliabilityManager(
-      channels: initTable[SdsChannelID, ChannelContext](), config: config
+      channels: initTable[SdsChannelID, ChannelContext](),
+      config: config,
+      resendQueue: initResendQueue(),
     )
     initLock(rm.lock)
+    initLock(rm.resendLock)
     return ok(rm)
   except Exception:
     error "Failed to create ReliabilityManager", msg = getCurrentExceptionMsg()
@@ -29,57 +46,239 @@ proc isAcknowledged*(
     causalHistory: seq[HistoryEntry],
     rbf: Option[RollingBloomFilter],
 ): bool =
-  if msg.message.messageId in causalHistory.getMessageIds():
-    return true
+  for entry in causalHistory:
+    if entry.messageId == msg.message.messageId:
+      return true
 
   if rbf.isSome():
-    return rbf.get().contains(msg.message.messageId)
+    return rbf.get().contains(msg.digest)
 
   false
 
-proc reviewAckStatus(rm: ReliabilityManager, msg: SdsMessage) {.gcsafe.} =
-  # Parse bloom filter
-  var rbf: Option[RollingBloomFilter]
-  if msg.bloomFilter.len > 0:
-    let bfResult = deserializeBloomFilter(msg.bloomFilter)
+proc fire(
+    rm: ReliabilityManager, channelId: SdsChannelID, events: openArray[ChannelEvent]
+) {.gcsafe.} =
+  ## Invokes the callbacks of ``events``, in order. No lock must be held.
+  if events.len == 0:
+    return
+
+  # Taken under the manager lock, as ``setCallbacks`` may replace them
+  var
+    onMessageReady: MessageReadyCallback
+    onMessageSent: MessageSentCallback
+    onMissingDependencies: MissingDependenciesCallback
+  withLock rm.lock:
+    onMessageReady = rm.onMessageReady
+    onMessageSent = rm.onMessageSent
+    onMissingDependencies = rm.onMissingDependencies
+
+  for event in events:
+    case event.kind
+    of ChannelEventKind.MessageReady:
+      if not onMessageReady.isNil():
+        onMessageReady(event.messageId, channelId)
+    of ChannelEventKind.MessageSent:
+      if not onMessageSent.isNil():
+        onMessageSent(event.messageId, channelId)
+    of ChannelEventKind.MissingDependencies:
+      if not onMissingDependencies.isNil():
+        onMissingDependencies(event.messageId, event.missingDeps, channelId)
+
+proc firePeriodicSync(rm: ReliabilityManager) {.gcsafe.} =
+  var onPeriodicSync: PeriodicSyncCallback
+  withLock rm.lock:
+    onPeriodicSync = rm.onPeriodicSync
+  try:
+    if not onPeriodicSync.isNil():
+      onPeriodicSync()
+  except Exception:
+    error "Error in periodic sync", msg = getCurrentExceptionMsg()
+
+proc reviewAckStatus(
+    channel: ChannelContext, msg: SdsMessageView, events: var seq[ChannelEvent]
+) {.gcsafe.} =
+  ## Removes from the outgoing buffer the messages acknowledged by ``msg``,
+  ## either through its causal history or its bloom filter.
+  if channel.outgoingBuffer.len == 0:
+    return
+
+  var
+    acked = newSeq[bool](channel.outgoingBuffer.len)
+    ackCount = 0
+
+  # Causal history acks are looked up by ID
+  for entry in msg.history:
+    channel.outgoingIndex.withValue(msg.toString(entry.messageId), pos):
+      if not acked[pos[]]:
+        acked[pos[]] = true
+        inc ackCount
+
+  # Remaining messages are probed against the bloom filter by cached digest.
+  # The filter is only decoded when some message still waits for an ack, and
+  # its bits are read in place from the received buffer.
+  if msg.bloomFilterSpan.len > 0 and ackCount < acked.len:
+    let bfResult = decodeBloomFilterView(msg.bytes(msg.bloomFilterSpan))
     if bfResult.isOk():
-      rbf = some(
-        RollingBloomFilter(
-          filter: bfResult.get(),
-          capacity: bfResult.get().capacity,
-          minCapacity: (
-            bfResult.get().capacity.float * (100 - CapacityFlexPercent).float / 100.0
-          ).int,
-          maxCapacity: (
-            bfResult.get().capacity.float * (100 + CapacityFlexPercent).float / 100.0
-          ).int,
-          messages: @[],
-        )
-      )
+      let bf = bfResult.get()
+      for i in 0 ..< channel.outgoingBuffer.len:
+        if not acked[i] and bf.lookup(channel.outgoingBuffer[i].digest):
+          acked[i] = true
+          inc ackCount
     else:
       error "Failed to deserialize bloom filter", error = bfResult.error
-      rbf = none[RollingBloomFilter]()
-  else:
-    rbf = none[RollingBloomFilter]()
 
-  if msg.channelId notin rm.channels:
+  if ackCount == 0:
     return
 
-  let channel = rm.channels[msg.channelId]
-  # Keep track of indices to delete
-  var toDelete: seq[int] = @[]
-  var i = 0
+  # Compact the buffer in a single pass, preserving order
+  var kept = 0
+  for i in 0 ..< channel.outgoingBuffer.len:
+    if acked[i]:
+      events.add(
+        ChannelEvent(
+          kind: ChannelEventKind.MessageSent,
+          messageId: channel.outgoingBuffer[i].message.messageId,
+        )
+      )
+    else:
+      if kept != i:
+        channel.outgoingBuffer[kept] = move(channel.outgoingBuffer[i])
+      inc kept
+  channel.outgoingBuffer.setLen(kept)
+  channel.reindexOutgoing()
+
+proc wrapOutgoing[O: seq[byte] | string | AllocatedBuffer](
+    rm: ReliabilityManager,
+    message: openArray[byte],
+    messageId: SdsMessageID,
+    channelId: SdsChannelID,
+    output: var O,
+): Result[void, ReliabilityError] =
+  if message.len == 0:
+    return err(ReliabilityError.reInvalidArgument)
+  if message.len > MaxMessageSize:
+    return err(ReliabilityError.reMessageTooLarge)
+
+  try:
+    let channel = rm.openChannel(channelId)
+    # Hints added to the history meanwhile are asked for by the next wrap
+    rm.askRetrievalHints(channel, channel.messageHistory.windowSize)
+    withLock channel.lock:
+      channel.updateLamportTimestamp(getTime().toUnix)
+
+      # The serialized filter is kept current by ``addToBloomFilter``, it is
+      # only serialized again after a rotation or while its bits are sparse
+      if channel.bloomFilter.dirty or channel.bloomFilterBytes.len == 0:
+        channel.bloomFilterBytes = serializeBloomFilter(
+          channel.bloomFilter.filter, channel.bloomFilterRawStart
+        ).valueOr:
+          error "Failed to serialize bloom filter", channelId = channelId
+          return err(ReliabilityError.reSerializationError)
+        channel.bloomFilter.dirty = false
+
+      # The causal history window is kept encoded by the history
+      template causalHistoryBytes(): untyped =
+        channel.messageHistory.causalWindow()
+
+      # The bloom filter bytes are lent to the message while it is serialized.
+      # If that fails they are serialized again by the next wrap.
+      var msg = SdsMessage(
+        messageId: messageId,
+        lamportTimestamp: channel.lamportTimestamp,
+        channelId: channelId,
+        content: @message,
+        bloomFilter: move(channel.bloomFilterBytes),
+      )
+
+      when O is seq[byte]:
+        ?serializeMessage(msg, causalHistoryBytes(), output)
+      elif O is string:
+        output.setLen(msg.encodedSize(causalHistoryBytes().len))
+        discard ?msg.encodeInto(
+          causalHistoryBytes(), output.toOpenArrayByte(0, output.high)
+        )
+      else:
+        # ``output`` is only set once the message is fully written to it
+        let
+          size = msg.encodedSize(causalHistoryBytes().len)
+          data = cast[ptr UncheckedArray[byte]](output.alloc(size))
+        if data.isNil():
+          return err(ReliabilityError.reOutOfMemory)
+        let written = msg.encodeInto(causalHistoryBytes(), data.toOpenArray(0, size - 1))
+        if written.isErr():
+          output.release(data)
+          return err(written.error)
+        output.data = data
+        output.len = size
+      channel.bloomFilterBytes = move(msg.bloomFilter)
+
+      let digest = bloomDigest(messageId)
+      let
+        sendTime = getTime()
+        resendDeadline = sendTime + rm.config.resendInterval
+      channel.outgoingIndex[messageId] = channel.outgoingBuffer.len
+      channel.outgoingBuffer.add(
+        UnacknowledgedMessage(
+          message: RetainedMessage(
+            messageId: messageId,
+            lamportTimestamp: msg.lamportTimestamp,
+            causalHistory: channel.messageHistory.windowIds(),
+            content: move(msg.content),
+          ),
+          digest: digest,
+          sendTime: sendTime,
+          resendDeadline: resendDeadline,
+          resendAttempts: 0,
+        )
+      )
+      withLock rm.resendLock:
+        rm.resendQueue.schedule(resendDeadline, channelId, messageId)
+
+      # Add to causal history and bloom filter
+      channel.addToBloomFilter(digest)
+      channel.addToHistory(messageId)
 
-  while i < channel.outgoingBuffer.len:
-    let outMsg = channel.outgoingBuffer[i]
-    if outMsg.isAcknowledged(msg.causalHistory, rbf):
-      if not rm.onMessageSent.isNil():
-        rm.onMessageSent(outMsg.message.messageId, outMsg.message.channelId)
-      toDelete.add(i)
-    inc i
+      return ok()
+  except Exception:
+    error "Failed to wrap message",
+      channelId = channelId, msg = getCurrentExceptionMsg()
+    return err(ReliabilityError.reSerializationError)
 
-  for i in countdown(toDelete.high, 0): # Delete in reverse order to maintain indices
-    channel.outgoingBuffer.delete(toDelete[i])
+proc wrapOutgoingMessage*(
+    rm: ReliabilityManager,
+    message: openArray[byte],
+    messageId: SdsMessageID,
+    channelId: SdsChannelID,
+    output: var seq[byte],
+): Result[void, ReliabilityError] =
+  ## Wraps an outgoing message with reliability metadata into ``output``.
+  ## ``output`` is resized to the exact wrapped size, so a buffer reused across
+  ## calls is only reallocated when a message outgrows it.
+  rm.wrapOutgoing(message, messageId, channelId, output)
+
+proc wrapOutgoingMessage*(
+    rm: ReliabilityManager,
+    message: openArray[byte],
+    messageId: SdsMessageID,
+    channelId: SdsChannelID,
+    output: var string,
+): Result[void, ReliabilityError] =
+  ## Like the ``seq[byte]`` overload, for callers handing the wrapped bytes
+  ## over as a string.
+  rm.wrapOutgoing(message, messageId, channelId, output)
+
+proc wrapOutgoingMessage*(
+    rm: ReliabilityManager,
+    message: openArray[byte],
+    messageId: SdsMessageID,
+    channelId: SdsChannelID,
+    output: var AllocatedBuffer,
+): Result[void, ReliabilityError] =
+  ## Wraps an outgoing message with reliability metadata into memory obtained
+  ## from ``output.alloc``, which is only called once the message is ready to
+  ## be written, with its exact size. The caller owns the memory on success;
+  ## on failure ``output`` is left unchanged and the memory already released.
+  rm.wrapOutgoing(message, messageId, channelId, output)
 
 proc wrapOutgoingMessage*(
     rm: ReliabilityManager,
@@ -96,144 +295,162 @@ proc wrapOutgoingMessage*(
   ##
   ## Returns:
   ##   A Result containing either wrapped message bytes or an error.
-  if message.len == 0:
-    return err(ReliabilityError.reInvalidArgument)
-  if message.len > MaxMessageSize:
-    return err(ReliabilityError.reMessageTooLarge)
+  var wrapped: seq[byte]
+  ?rm.wrapOutgoingMessage(message, messageId, channelId, wrapped)
+  ok(wrapped)
 
-  withLock rm.lock:
-    try:
-      let channel = rm.getOrCreateChannel(channelId)
-      rm.updateLamportTimestamp(getTime().toUnix, channelId)
+proc bufferIncoming(
+    channel: ChannelContext, msg: RetainedMessage, missingDeps: HashSet[SdsMessageID]
+) =
+  ## Buffers ``msg`` until ``missingDeps`` are met and indexes it under each of them.
+  channel.incomingBuffer[msg.messageId] =
+    IncomingMessage(message: msg, missingDeps: missingDeps)
+  for depId in missingDeps:
+    channel.dependents.mgetOrPut(depId, @[]).add(msg.messageId)
+
+proc resolveDependency(
+    channel: ChannelContext, depId: SdsMessageID, ready: var seq[SdsMessageID]
+) =
+  ## Removes ``depId`` from the messages waiting on it, adding to ``ready``
+  ## those that have no missing dependencies left.
+  var waiting: seq[SdsMessageID]
+  if not channel.dependents.pop(depId, waiting):
+    return
 
-      let bfResult = serializeBloomFilter(channel.bloomFilter.filter)
-      if bfResult.isErr:
-        error "Failed to serialize bloom filter", channelId = channelId
-        return err(ReliabilityError.reSerializationError)
+  for msgId in waiting:
+    channel.incomingBuffer.withValue(msgId, entry):
+      entry.missingDeps.excl(depId)
+      if entry.missingDeps.len == 0:
+        ready.add(msgId)
 
-      let msg = SdsMessage(
-        messageId: messageId,
-        lamportTimestamp: channel.lamportTimestamp,
-        causalHistory: rm.getRecentHistoryEntries(rm.config.maxCausalHistory, channelId),
-        channelId: channelId,
-        content: message,
-        bloomFilter: bfResult.get(),
-      )
+proc processIncomingBuffer(
+    channel: ChannelContext, resolved: seq[SdsMessageID], events: var seq[ChannelEvent]
+) {.gcsafe.} =
+  ## Releases the buffered messages unblocked by the ``resolved`` IDs, and then
+  ## those unblocked in turn by each released message. Only the direct
+  ## dependents of each resolved ID are visited.
+  if channel.incomingBuffer.len == 0:
+    return
 
-      channel.outgoingBuffer.add(
-        UnacknowledgedMessage(message: msg, sendTime: getTime(), resendAttempts: 0)
-      )
+  var readyToProcess = newSeq[SdsMessageID]()
+  for depId in resolved:
+    channel.resolveDependency(depId, readyToProcess)
 
-      # Add to causal history and bloom filter
-      channel.bloomFilter.add(msg.messageId)
-      rm.addToHistory(msg.messageId, channelId)
+  while readyToProcess.len > 0:
+    let msgId = readyToProcess.pop()
+    var entry: IncomingMessage
+    if not channel.incomingBuffer.pop(msgId, entry):
+      continue # Already released
 
-      return serializeMessage(msg)
-    except Exception:
-      error "Failed to wrap message",
-        channelId = channelId, msg = getCurrentExceptionMsg()
-      return err(ReliabilityError.reSerializationError)
+    channel.addToHistory(msgId)
+    events.add(ChannelEvent(kind: ChannelEventKind.MessageReady, messageId: msgId))
 
-proc processIncomingBuffer(rm: ReliabilityManager, channelId: SdsChannelID) {.gcsafe.} =
-  withLock rm.lock:
-    if channelId notin rm.channels:
-      error "Channel does not exist", channelId = channelId
-      return
+    channel.resolveDependency(msgId, readyToProcess)
 
-    let channel = rm.channels[channelId]
-    if channel.incomingBuffer.len == 0:
-      return
+proc unwrapReceivedMessage*(
+    rm: ReliabilityManager, msg: SdsMessageView
+): Result[
+    tuple[message: seq[byte], missingDeps: seq[HistoryEntry], channelId: SdsChannelID],
+    ReliabilityError,
+] =
+  ## Processes the reliability metadata of an already decoded message. The
+  ## buffer ``msg`` was decoded from must still be alive.
+  ##
+  ## Only the message and dependency IDs, the returned content and the missing
+  ## dependencies are copied, and the whole message only when it has to be
+  ## buffered. Duplicates are dropped before their history is even validated.
+  try:
+    let
+      msgId = msg.messageId
+      channelId = msg.channelId
+
+    let channel = rm.openChannel(channelId)
+    var
+      missingDeps: seq[HistoryEntry] = @[]
+      events: seq[ChannelEvent]
+    withLock channel.lock:
+      if msgId in channel.messageHistory:
+        return ok((msg.content, @[], channelId))
+
+      if msg.validateHistory().isErr():
+        return err(ReliabilityError.reDeserializationError)
+
+      channel.addToBloomFilter(msgId)
+
+      channel.updateLamportTimestamp(msg.lamportTimestamp)
+      # Review ACK status for outgoing messages
+      channel.reviewAckStatus(msg, events)
+
+      var bufferedDeps = initHashSet[SdsMessageID]()
+      for entry in msg.history:
+        let depId = msg.toString(entry.messageId)
+        if depId notin channel.messageHistory:
+          missingDeps.add(msg.toHistoryEntry(entry))
+          continue
+
+        # Learn the hints peers attach to messages we have
+        if entry.retrievalHint.len > 0:
+          discard channel.messageHistory.setRetrievalHint(
+            depId, msg.bytes(entry.retrievalHint)
+          )
+        if depId in channel.incomingBuffer:
+          # Check if any dependencies are still in incoming buffer
+          bufferedDeps.incl(depId)
+
+      if missingDeps.len == 0:
+        if bufferedDeps.len > 0:
+          channel.bufferIncoming(msg.toRetained(), bufferedDeps)
+        else:
+          # All dependencies met, add to history and release what waited on it
+          channel.addToHistory(msgId)
+          events.add(ChannelEvent(kind: ChannelEventKind.MessageReady, messageId: msgId))
+          channel.processIncomingBuffer(@[msgId], events)
+      else:
+        channel.bufferIncoming(msg.toRetained(), missingDeps.getMessageIds().toHashSet())
+        events.add(
+          ChannelEvent(
+            kind: ChannelEventKind.MissingDependencies,
+            messageId: msgId,
+            missingDeps: missingDeps,
+          )
+        )
 
-    var processed = initHashSet[SdsMessageID]()
-    var readyToProcess = newSeq[SdsMessageID]()
+    rm.fire(channelId, events)
+    return ok((msg.content, missingDeps, channelId))
+  except Exception:
+    error "Failed to unwrap message", msg = getCurrentExceptionMsg()
+    return err(ReliabilityError.reDeserializationError)
 
-    # Find initially ready messages
-    for msgId, entry in channel.incomingBuffer:
-      if entry.missingDeps.len == 0:
-        readyToProcess.add(msgId)
-
-    while readyToProcess.len > 0:
-      let msgId = readyToProcess.pop()
-      if msgId in processed:
-        continue
-
-      if msgId in channel.incomingBuffer:
-        rm.addToHistory(msgId, channelId)
-        if not rm.onMessageReady.isNil():
-          rm.onMessageReady(msgId, channelId)
-        processed.incl(msgId)
-
-        # Update dependencies for remaining messages
-        for remainingId, entry in channel.incomingBuffer:
-          if remainingId notin processed:
-            if msgId in entry.missingDeps:
-              channel.incomingBuffer[remainingId].missingDeps.excl(msgId)
-              if channel.incomingBuffer[remainingId].missingDeps.len == 0:
-                readyToProcess.add(remainingId)
-
-    # Remove processed messages
-    for msgId in processed:
-      channel.incomingBuffer.del(msgId)
+proc decodeReceivedMessage*(
+    message: openArray[byte]
+): Result[SdsMessageView, ReliabilityError] =
+  ## Decodes a received message in place, see ``SdsMessageView.decode``.
+  try:
+    let msg = SdsMessageView.decode(message).valueOr:
+      return err(ReliabilityError.reDeserializationError)
+    return ok(msg)
+  except Exception:
+    error "Failed to decode message", msg = getCurrentExceptionMsg()
+    return err(ReliabilityError.reDeserializationError)
 
 proc unwrapReceivedMessage*(
-    rm: ReliabilityManager, message: seq[byte]
+    rm: ReliabilityManager, message: openArray[byte]
 ): Result[
     tuple[message: seq[byte], missingDeps: seq[HistoryEntry], channelId: SdsChannelID],
     ReliabilityError,
 ] =
   ## Unwraps a received message and processes its reliability metadata.
   ##
+  ## The message is decoded in place, in a single pass that also yields its
+  ## channel ID.
+  ##
   ## Parameters:
   ##   - message: The received message bytes
   ##
   ## Returns:
   ##   A Result containing either tuple of (processed message, missing dependencies, channel ID) or an error.
-  try:
-    let channelId = extractChannelId(message).valueOr:
-      return err(ReliabilityError.reDeserializationError)
-
-    let msg = deserializeMessage(message).valueOr:
-      return err(ReliabilityError.reDeserializationError)
-
-    let channel = rm.getOrCreateChannel(channelId)
-
-    if msg.messageId in channel.messageHistory:
-      return ok((msg.content, @[], channelId))
-
-    channel.bloomFilter.add(msg.messageId)
-
-    rm.updateLamportTimestamp(msg.lamportTimestamp, channelId)
-    # Review ACK status for outgoing messages
-    rm.reviewAckStatus(msg)
-
-    var missingDeps = rm.checkDependencies(msg.causalHistory, channelId)
-
-    if missingDeps.len == 0:
-      var depsInBuffer = false
-      for msgId, entry in channel.incomingBuffer.pairs():
-        if msgId in msg.causalHistory.getMessageIds():
-          depsInBuffer = true
-          break
-      # Check if any dependencies are still in incoming buffer
-      if depsInBuffer:
-        channel.incomingBuffer[msg.messageId] =
-          IncomingMessage(message: msg, missingDeps: initHashSet[SdsMessageID]())
-      else:
-        # All dependencies met, add to history
-        rm.addToHistory(msg.messageId, channelId)
-        rm.processIncomingBuffer(channelId)
-        if not rm.onMessageReady.isNil():
-          rm.onMessageReady(msg.messageId, channelId)
-    else:
-      channel.incomingBuffer[msg.messageId] =
-        IncomingMessage(message: msg, missingDeps: missingDeps.getMessageIds().toHashSet())
-      if not rm.onMissingDependencies.isNil():
-        rm.onMissingDependencies(msg.messageId, missingDeps, channelId)
-
-    return ok((msg.content, missingDeps, channelId))
-  except Exception:
-    error "Failed to unwrap message", msg = getCurrentExceptionMsg()
-    return err(ReliabilityError.reDeserializationError)
+  let msg = ?decodeReceivedMessage(message)
+  rm.unwrapReceivedMessage(msg)
 
 proc markDependenciesMet*(
     rm: ReliabilityManager, messageIds: seq[SdsMessageID], channelId: SdsChannelID
@@ -246,21 +463,19 @@ proc markDependenciesMet*(
   ##
   ## Returns:
   ##   A Result indicating success or an error.
-  try:
-    if channelId notin rm.channels:
-      return err(ReliabilityError.reInvalidArgument)
-
-    let channel = rm.channels[channelId]
-
-    for msgId in messageIds:
-      if not channel.bloomFilter.contains(msgId):
-        channel.bloomFilter.add(msgId)
-
-      for pendingId, entry in channel.incomingBuffer:
-        if msgId in entry.missingDeps:
-          channel.incomingBuffer[pendingId].missingDeps.excl(msgId)
+  let channel = rm.getChannel(channelId)
+  if channel.isNil():
+    return err(ReliabilityError.reInvalidArgument)
 
-    rm.processIncomingBuffer(channelId)
+  try:
+    var events: seq[ChannelEvent]
+    withLock channel.lock:
+      for msgId in messageIds:
+        if not channel.bloomFilter.contains(msgId):
+          channel.addToBloomFilter(msgId)
+
+      channel.processIncomingBuffer(messageIds, events)
+    rm.fire(channelId, events)
     return ok()
   except Exception:
     error "Failed to mark dependencies as met",
@@ -283,6 +498,9 @@ proc setCallbacks*(
   ##   - onMissingDependencies: Callback function called when a message has missing dependencies.
   ##   - onPeriodicSync: Callback function called to notify about periodic sync
   ##   - onRetrievalHint: Callback function called to get a retrieval hint for a message ID.
+  ##
+  ## Callbacks are called without any lock held, so they may call back into
+  ## the manager.
   withLock rm.lock:
     rm.onMessageReady = onMessageReady
     rm.onMessageSent = onMessageSent
@@ -290,65 +508,136 @@ proc setCallbacks*(
     rm.onPeriodicSync = onPeriodicSync
     rm.onRetrievalHint = onRetrievalHint
 
-proc checkUnacknowledgedMessages(
-    rm: ReliabilityManager, channelId: SdsChannelID
-) {.gcsafe.} =
-  ## Checks and processes unacknowledged messages in the outgoing buffer.
-  withLock rm.lock:
-    if channelId notin rm.channels:
-      error "Channel does not exist", channelId = channelId
+proc resendDue(
+    rm: ReliabilityManager,
+    channelId: SdsChannelID,
+    dues: seq[ResendDeadline],
+    now: Time,
+): int {.gcsafe.} =
+  ## Resends or expires the messages of ``channelId`` whose entries ``dues``
+  ## were popped from the resend queue. Returns how many of the entries were
+  ## live, the others being left by acknowledged or rescheduled messages.
+  let channel = rm.getChannel(channelId)
+  if channel.isNil():
+    return 0 # Channel removed since
+
+  var events: seq[ChannelEvent]
+  withLock channel.lock:
+    var expired: seq[int] = @[]
+    for due in dues:
+      let pos = channel.outgoingIndex.getOrDefault(due.messageId, -1)
+      if pos < 0:
+        continue # Acknowledged since
+
+      let unackMsg = addr channel.outgoingBuffer[pos]
+      if unackMsg.resendDeadline != due.deadline:
+        continue # Stale entry, the message was rescheduled
+
+      inc result
+      if unackMsg.resendAttempts < rm.config.maxResendAttempts:
+        unackMsg.resendAttempts += 1
+        unackMsg.sendTime = now
+        unackMsg.resendDeadline = now + rm.config.resendInterval
+        withLock rm.resendLock:
+          rm.resendQueue.schedule(unackMsg.resendDeadline, channelId, due.messageId)
+      else:
+        events.add(
+          ChannelEvent(kind: ChannelEventKind.MessageSent, messageId: due.messageId)
+        )
+        expired.add(pos)
+
+    if expired.len > 0:
+      var drop = newSeq[bool](channel.outgoingBuffer.len)
+      for pos in expired:
+        drop[pos] = true
+
+      var kept = 0
+      for i in 0 ..< channel.outgoingBuffer.len:
+        if not drop[i]:
+          if kept != i:
+            channel.outgoingBuffer[kept] = move(channel.outgoingBuffer[i])
+          inc kept
+      channel.outgoingBuffer.setLen(kept)
+      channel.reindexOutgoing()
+
+  rm.fire(channelId, events)
+
+proc checkUnacknowledgedMessages(rm: ReliabilityManager, budget: int) {.gcsafe.} =
+  ## Processes the unacknowledged messages whose resend deadline has passed.
+  ## Only expired entries of the resend queue are visited, and at most
+  ## ``budget`` messages are resent or expired. Stale entries are dropped
+  ## without counting against ``budget``.
+  let now = getTime()
+  var processed = 0
+  while processed < budget:
+    var
+      due: ResendDeadline
+      popped = 0
+      dueByChannel = initTable[SdsChannelID, seq[ResendDeadline]]()
+    withLock rm.resendLock:
+      while popped < budget - processed and rm.resendQueue.popExpired(now, due):
+        dueByChannel.mgetOrPut(due.channelId, @[]).add(due)
+        inc popped
+    if popped == 0:
       return
 
-    let channel = rm.channels[channelId]
-    let now = getTime()
-    var newOutgoingBuffer: seq[UnacknowledgedMessage] = @[]
-
-    for unackMsg in channel.outgoingBuffer:
-      let elapsed = now - unackMsg.sendTime
-      if elapsed > rm.config.resendInterval:
-        if unackMsg.resendAttempts < rm.config.maxResendAttempts:
-          var updatedMsg = unackMsg
-          updatedMsg.resendAttempts += 1
-          updatedMsg.sendTime = now
-          newOutgoingBuffer.add(updatedMsg)
-        else:
-          if not rm.onMessageSent.isNil():
-            rm.onMessageSent(unackMsg.message.messageId, channelId)
-      else:
-        newOutgoingBuffer.add(unackMsg)
+    for channelId, dues in dueByChannel:
+      processed += rm.resendDue(channelId, dues, now)
 
-    channel.outgoingBuffer = newOutgoingBuffer
+proc sweepBuffers(rm: ReliabilityManager): times.Duration =
+  ## Resends or expires the unacknowledged messages that are due, within
+  ## ``maintenanceBudget``. Only channels with such messages are visited;
+  ## bloom filters need no sweep, they rotate as IDs are added. Returns how
+  ## long until this is due again.
+  let budget =
+    if rm.config.maintenanceBudget > 0: rm.config.maintenanceBudget else: high(int)
+  try:
+    rm.checkUnacknowledgedMessages(budget)
+  except Exception:
+    error "Error checking unacknowledged messages", msg = getCurrentExceptionMsg()
+
+  # Due at the next resend deadline, right away if the budget left expired
+  # ones over. Messages wrapped meanwhile are due no earlier than
+  # ``resendInterval`` from now.
+  result = min(rm.config.bufferSweepInterval, rm.config.resendInterval)
+  withLock rm.resendLock:
+    if rm.resendQueue.len > 0:
+      result = min(result, rm.resendQueue.nextDeadline() - getTime())
+  # Deadlines are strict, be due just after them
+  result = max(result, DurationZero) + initDuration(milliseconds = 1)
 
 proc periodicBufferSweep(
     rm: ReliabilityManager
 ) {.async: (raises: [CancelledError]), gcsafe.} =
-  ## Periodically sweeps the buffer to clean up and check unacknowledged messages.
+  ## Resends or expires unacknowledged messages as their deadlines pass.
   while true:
-    try:
-      for channelId, channel in rm.channels:
-        try:
-          rm.checkUnacknowledgedMessages(channelId)
-          rm.cleanBloomFilter(channelId)
-        except Exception:
-          error "Error in buffer sweep for channel",
-            channelId = channelId, msg = getCurrentExceptionMsg()
-    except Exception:
-      error "Error in periodic buffer sweep", msg = getCurrentExceptionMsg()
-
-    await sleepAsync(chronos.milliseconds(rm.config.bufferSweepInterval.inMilliseconds))
+    let wait = rm.sweepBuffers()
+    await sleepAsync(chronos.milliseconds(wait.inMilliseconds))
 
 proc periodicSyncMessage(
     rm: ReliabilityManager
 ) {.async: (raises: [CancelledError]), gcsafe.} =
   ## Periodically notifies to send a sync message to maintain connectivity.
   while true:
-    try:
-      if not rm.onPeriodicSync.isNil():
-        rm.onPeriodicSync()
-    except Exception:
-      error "Error in periodic sync", msg = getCurrentExceptionMsg()
+    rm.firePeriodicSync()
     await sleepAsync(chronos.seconds(rm.config.syncMessageInterval.inSeconds))
 
+proc tick*(rm: ReliabilityManager): times.Duration =
+  ## Runs the periodic work that is due, for embedders driving the manager
+  ## themselves instead of calling ``startPeriodicTasks``: resends and expiries
+  ## as by the buffer sweep, and ``onPeriodicSync`` every
+  ## ``syncMessageInterval``. The first call fires ``onPeriodicSync``.
+  ##
+  ## Returns how long until the next call is due.
+  result = rm.sweepBuffers()
+
+  let now = getTime()
+  if now - rm.lastPeriodicSync >= rm.config.syncMessageInterval:
+    rm.lastPeriodicSync = now
+    rm.firePeriodicSync()
+  result = min(result, rm.config.syncMessageInterval - (getTime() - rm.lastPeriodicSync))
+  result = max(result, DurationZero)
+
 proc startPeriodicTasks*(rm: ReliabilityManager) =
   ## Starts the periodic tasks for buffer sweeping and sync message sending.
   ##
@@ -363,14 +652,20 @@ proc resetReliabilityManager*(rm: ReliabilityManager): Result[void, ReliabilityE
   withLock rm.lock:
     try:
       for channelId, channel in rm.channels:
-        channel.lamportTimestamp = 0
-        channel.messageHistory.setLen(0)
-        channel.outgoingBuffer.setLen(0)
-        channel.incomingBuffer.clear()
-        channel.bloomFilter = newRollingBloomFilter(
-          rm.config.bloomFilterCapacity, rm.config.bloomFilterErrorRate
-        )
+        withLock channel.lock:
+          channel.lamportTimestamp = 0
+          channel.messageHistory.clear()
+          channel.outgoingBuffer.setLen(0)
+          channel.outgoingIndex.clear()
+          channel.incomingBuffer.clear()
+          channel.dependents.clear()
+          channel.bloomFilter = newRollingBloomFilter(
+            rm.config.bloomFilterCapacity, rm.config.bloomFilterErrorRate,
+            rm.config.bloomFilterKind,
+          )
       rm.channels.clear()
+      withLock rm.resendLock:
+        rm.resendQueue.clear()
       return ok()
     except Exception:
       error "Failed to reset ReliabilityManager", msg = getCurrentExceptionMsg()
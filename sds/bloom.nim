@@ -1,34 +1,90 @@
 from math import ceil, ln, pow, round
-import hashes
+import std/endians
 import strutils
 import results
-import private/probabilities
+import private/[probabilities, murmur3]
 
-type BloomFilter* = object
-  capacity*: int
-  errorRate*: float
-  kHashes*: int
-  mBits*: int
-  intArray*: seq[int]
+type
+  BloomFilterKind* {.pure.} = enum
+    Standard ## The k bits of an item are spread over the whole bit array
+    Blocked ## The k bits of an item all fall inside one 512-bit block
 
-{.push overflowChecks: off.} # Turn off overflow checks for hashing operations
+  BloomDigest* = tuple[h1, h2: uint64]
+    ## 128-bit hash of an item, enough to insert it into or look it up in any
+    ## filter. Computing it once lets callers probe several filters, or the
+    ## same filter many times, without hashing the item again.
 
-proc hashN(item: string, n: int, maxValue: int): int =
-  ## Get the nth hash using Nim's built-in hash function using
-  ## the double hashing technique from Kirsch and Mitzenmacher, 2008:
+  BloomFilter* = object
+    capacity*: int
+    errorRate*: float
+    kHashes*: int
+    mBits*: int
+    intArray*: seq[int]
+    kind*: BloomFilterKind
+
+const
+  BlockBits* = 512
+    ## Size of a ``Blocked`` filter block, that of a typical 64-byte cache line.
+    ## ``intArray`` is not aligned on cache lines, so a block may span two.
+  BlockWords = BlockBits div (sizeof(int) * 8)
+  MaxHashes* = 64
+    ## Most hash functions a received filter may use, every probe of it costs
+    ## that many bit lookups. Filters built here use at most 12.
+  BlockedExtraBitsPerElem = 1
+    ## Blocked filters are slightly less accurate than standard ones for the
+    ## same size, this extra bit per element brings them back under the target rate
+
+type BlockMask = array[BlockWords, int]
+
+proc bloomDigest*(item: string): BloomDigest {.inline.} =
+  ## Stable 128-bit hash of ``item``, split into the two halves used for
+  ## double hashing. Unlike ``hashes.hash`` it does not depend on the Nim
+  ## version or the word size, so filters stay comparable between peers.
+  murmurHash3x64_128(item.toOpenArrayByte(0, item.high))
+
+iterator probes(bf: BloomFilter, digest: BloomDigest): int =
+  ## Yields the ``kHashes`` bit indexes of ``item`` using the double hashing
+  ## technique from Kirsch and Mitzenmacher, 2008:
   ## http://www.eecs.harvard.edu/~kirsch/pubs/bbbf/rsa.pdf
+  ## No memory is allocated.
   let
-    hashA = abs(hash(item)) mod maxValue # Use abs to handle negative hashes
-    hashB = abs(hash(item & " b")) mod maxValue # string concatenation
-  abs((hashA + n * hashB)) mod maxValue
-  #   # Use bit rotation for second hash instead of string concatenation if speed if preferred over FP-rate
-  #   # Rotate left by 21 bits (lower the rotation, higher the speed but higher the FP-rate too)
-  #   hashB = abs(
-  #     ((h shl 21) or (h shr (sizeof(int) * 8 - 21)))
-  #   ) mod maxValue
-  # abs((hashA + n.int64 * hashB)) mod maxValue
-
-{.pop.}
+    m = uint64(bf.mBits)
+    step = digest.h2 mod m
+  var idx = digest.h1 mod m
+  for _ in 0 ..< bf.kHashes:
+    yield int(idx)
+    idx = (idx + step) mod m
+
+iterator bitIndexes*(bf: BloomFilter, digest: BloomDigest): int =
+  ## Yields the indexes in the whole bit array of the bits ``digest`` maps to.
+  ## Only the shape of ``bf`` is read, not ``intArray``, so this serves to probe
+  ## bits stored elsewhere, such as in a serialized filter.
+  case bf.kind
+  of BloomFilterKind.Standard:
+    for h in bf.probes(digest):
+      yield h
+  of BloomFilterKind.Blocked:
+    # The step is odd, so the k bit positions within the block are distinct
+    let
+      nBlocks = uint64(bf.mBits div BlockBits)
+      step = (digest.h1 shr 32) or 1
+      base = int(digest.h1 mod nBlocks) * BlockBits
+    var pos = digest.h2
+    for _ in 0 ..< bf.kHashes:
+      yield base + int(pos and uint64(BlockBits - 1))
+      pos += step
+
+proc blockProbe(
+    bf: BloomFilter, digest: BloomDigest
+): tuple[base: int, mask: BlockMask] =
+  ## Returns the first word of the block selected for ``digest`` in a ``Blocked``
+  ## filter, together with the mask of its ``kHashes`` bits inside that block.
+  for bit in bf.bitIndexes(digest):
+    let inBlock = bit mod BlockBits
+    result.mask[inBlock div (sizeof(int) * 8)] =
+      result.mask[inBlock div (sizeof(int) * 8)] or
+      (1 shl (inBlock mod (sizeof(int) * 8)))
+    result.base = (bit div BlockBits) * BlockWords
 
 proc getMOverNBitsForK*(
     k: int, targetError: float, probabilityTable = kErrors
@@ -45,8 +101,20 @@ proc getMOverNBitsForK*(
     "Specified value of k and error rate not achievable using less than 4 bytes / element."
   )
 
+proc intArrayLen*(mBits: int, kind: BloomFilterKind): int =
+  ## Number of ints backing a filter of ``mBits`` bits with the given layout.
+  case kind
+  of BloomFilterKind.Standard:
+    1 + mBits div (sizeof(int) * 8)
+  of BloomFilterKind.Blocked:
+    mBits div (sizeof(int) * 8)
+
 proc initializeBloomFilter*(
-    capacity: int, errorRate: float, k = 0, forceNBitsPerElem = 0
+    capacity: int,
+    errorRate: float,
+    k = 0,
+    forceNBitsPerElem = 0,
+    kind = BloomFilterKind.Standard,
 ): Result[BloomFilter, string] =
   ## Initializes a Bloom filter with specified parameters.
   ##
@@ -57,6 +125,8 @@ proc initializeBloomFilter*(
   ## See http://pages.cs.wisc.edu/~cao/papers/summary-cache/node8.html for
   ## useful tables on k and m/n (n bits per element) combinations.
   ## - forceNBitsPerElem: Optional override for bits per element
+  ## - kind: Bit layout. ``Blocked`` trades a little memory for accessing a
+  ##   single 512-bit block, at most two cache lines, per insert and lookup
   var
     kHashes: int
     nBitsPerElem: int
@@ -75,9 +145,13 @@ proc initializeBloomFilter*(
       nBitsPerElem = forceNBitsPerElem
     kHashes = k
 
-  let
-    mBits = capacity * nBitsPerElem
-    mInts = 1 + mBits div (sizeof(int) * 8)
+  if kind == BloomFilterKind.Blocked and forceNBitsPerElem < 1:
+    nBitsPerElem += BlockedExtraBitsPerElem
+
+  var mBits = capacity * nBitsPerElem
+  if kind == BloomFilterKind.Blocked:
+    mBits = max(1, (mBits + BlockBits - 1) div BlockBits) * BlockBits
+  let mInts = intArrayLen(mBits, kind)
 
   ok(
     BloomFilter(
@@ -86,6 +160,7 @@ proc initializeBloomFilter*(
       kHashes: kHashes,
       mBits: mBits,
       intArray: newSeq[int](mInts),
+      kind: kind,
     )
   )
 
@@ -99,32 +174,55 @@ proc `$`*(bf: BloomFilter): string =
     $(bf.mBits div bf.capacity),
   ]
 
-proc computeHashes(bf: BloomFilter, item: string): seq[int] =
-  var hashes = newSeq[int](bf.kHashes)
-  for i in 0 ..< bf.kHashes:
-    hashes[i] = hashN(item, i, bf.mBits)
-  hashes
+proc insert*(bf: var BloomFilter, digest: BloomDigest) =
+  ## Insert an item, given by its ``bloomDigest``, into the Bloom filter.
+  case bf.kind
+  of BloomFilterKind.Standard:
+    for h in bf.probes(digest):
+      let
+        intAddress = h div (sizeof(int) * 8)
+        bitOffset = h mod (sizeof(int) * 8)
+      bf.intArray[intAddress] = bf.intArray[intAddress] or (1 shl bitOffset)
+  of BloomFilterKind.Blocked:
+    let (base, mask) = bf.blockProbe(digest)
+    for w in 0 ..< BlockWords:
+      bf.intArray[base + w] = bf.intArray[base + w] or mask[w]
 
 proc insert*(bf: var BloomFilter, item: string) =
   ## Insert an item (string) into the Bloom filter.
-  let hashSet = bf.computeHashes(item)
-  for h in hashSet:
-    let
-      intAddress = h div (sizeof(int) * 8)
-      bitOffset = h mod (sizeof(int) * 8)
-    bf.intArray[intAddress] = bf.intArray[intAddress] or (1 shl bitOffset)
+  bf.insert(bloomDigest(item))
+
+proc lookup*(bf: BloomFilter, digest: BloomDigest): bool =
+  ## Lookup an item, given by its ``bloomDigest``, in the Bloom filter.
+  case bf.kind
+  of BloomFilterKind.Standard:
+    for h in bf.probes(digest):
+      let
+        intAddress = h div (sizeof(int) * 8)
+        bitOffset = h mod (sizeof(int) * 8)
+      if (bf.intArray[intAddress] and (1 shl bitOffset)) == 0:
+        return false
+    true
+  of BloomFilterKind.Blocked:
+    # Branch-free compare of the whole block against the mask, which the C
+    # compiler can turn into a handful of vector instructions.
+    let (base, mask) = bf.blockProbe(digest)
+    var missing = 0
+    for w in 0 ..< BlockWords:
+      missing = missing or (mask[w] and not bf.intArray[base + w])
+    missing == 0
 
 proc lookup*(bf: BloomFilter, item: string): bool =
   ## Lookup an item (string) in the Bloom filter.
   ## If the item is present, ``lookup`` is guaranteed to return ``true``.
   ## If the item is not present, ``lookup`` will return ``false``
   ## with a probability 1 - ``bf.errorRate``.
-  let hashSet = bf.computeHashes(item)
-  for h in hashSet:
-    let
-      intAddress = h div (sizeof(int) * 8)
-      bitOffset = h mod (sizeof(int) * 8)
-      currentInt = bf.intArray[intAddress]
-    if currentInt != (currentInt or (1 shl bitOffset)):
-      return false
-  true
+  bf.lookup(bloomDigest(item))
+
+proc patchRawBits*(bf: BloomFilter, digest: BloomDigest, raw: var openArray[byte]) =
+  ## Copies the words of ``intArray`` holding the bits of ``digest`` to ``raw``,
+  ## the bit array serialized as little-endian words, so that a serialized
+  ## copy stays current after ``digest`` is inserted.
+  for bit in bf.bitIndexes(digest):
+    let start = (bit div (sizeof(int) * 8)) * sizeof(int)
+    littleEndian64(addr raw[start], unsafeAddr bf.intArray[bit div (sizeof(int) * 8)])
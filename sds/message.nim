@@ -1,4 +1,5 @@
 import std/[times, sets]
+import ./bloom
 
 type
   SdsMessageID* = string
@@ -16,13 +17,26 @@ type
     content*: seq[byte]
     bloomFilter*: seq[byte]
 
+  RetainedMessage* = object
+    ## What the buffers keep of an ``SdsMessage``. The channel is known from
+    ## the buffer, and neither the bloom filter snapshot nor the retrieval
+    ## hints are read once a message is wrapped or received.
+    messageId*: SdsMessageID
+    lamportTimestamp*: int64
+    causalHistory*: seq[SdsMessageID]
+    content*: seq[byte]
+
   UnacknowledgedMessage* = object
-    message*: SdsMessage
+    message*: RetainedMessage
+    digest*: BloomDigest ## ``bloomDigest`` of the message ID, for acknowledgement checks
     sendTime*: Time
+    resendDeadline*: Time
+      ## Deadline of the live entry of the message in the resend queue, the
+      ## entries with another deadline are stale
     resendAttempts*: int
 
   IncomingMessage* = object
-    message*: SdsMessage
+    message*: RetainedMessage
     missingDeps*: HashSet[SdsMessageID]
 
 const
@@ -32,4 +46,5 @@ const
   DefaultMaxResendAttempts* = 5
   DefaultSyncMessageInterval* = initDuration(seconds = 30)
   DefaultBufferSweepInterval* = initDuration(seconds = 60)
+  DefaultMaintenanceBudget* = 1000
   MaxMessageSize* = 1024 * 1024 # 1 MB
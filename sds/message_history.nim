@@ -0,0 +1,194 @@
+import std/tables
+import ./[message, protobufutil]
+
+type
+  HistoryRecord* = object
+    messageId*: SdsMessageID
+    retrievalHint*: seq[byte]
+    hintKnown*: bool
+      ## Whether a non-empty ``retrievalHint`` was learnt, so that the hint
+      ## provider is not asked again. Providers may only know a hint later.
+    encoded*: seq[byte]
+      ## The ID and hint encoded as a causal history entry of an ``SdsMessage``
+
+  MessageHistory* = object
+    ## Fixed-capacity ring of the most recent message IDs of a channel, kept in
+    ## arrival order, with a hash index for constant time membership checks.
+    ## Adding to a full history evicts the oldest ID. The retrieval hint of
+    ## each ID is cached next to it once known.
+    ##
+    ## The causal history window, the ``windowSize`` most recent entries, is
+    ## also kept encoded in one block that slides as IDs are added.
+    entries: seq[HistoryRecord]
+    head: int ## Position of the oldest ID in ``entries``
+    count: int
+    index: Table[SdsMessageID, tuple[occurrences, latest: int]]
+      ## Occurrences of each ID in ``entries`` and position of the most recent
+    windowSize: int
+    window: seq[byte] ## Encoded records of the window, oldest first
+    windowDirty: bool
+      ## Set when a record of the window was encoded again; ``window`` is then
+      ## rebuilt by ``causalWindow``
+
+proc initMessageHistory*(capacity: int, windowSize = 0): MessageHistory =
+  ## Creates an empty history holding at most ``capacity`` IDs, of which the
+  ## ``windowSize`` most recent form the causal history window.
+  let capacity = max(0, capacity)
+  MessageHistory(
+    entries: newSeq[HistoryRecord](capacity),
+    index: initTable[SdsMessageID, tuple[occurrences, latest: int]](),
+    windowSize: clamp(windowSize, 0, capacity),
+  )
+
+proc len*(history: MessageHistory): int =
+  history.count
+
+proc capacity*(history: MessageHistory): int =
+  history.entries.len
+
+proc windowSize*(history: MessageHistory): int =
+  history.windowSize
+
+proc contains*(history: MessageHistory, msgId: SdsMessageID): bool =
+  msgId in history.index
+
+proc slot(history: MessageHistory, i: int): int {.inline.} =
+  ## Position in ``entries`` of the ``i``-th oldest ID.
+  (history.head + i) mod history.entries.len
+
+proc inWindow(history: MessageHistory, pos: int): bool =
+  let i = (pos - history.head + history.entries.len) mod history.entries.len
+  i >= history.count - history.windowSize
+
+proc `[]`*(history: MessageHistory, i: int): SdsMessageID =
+  ## Returns the ``i``-th oldest ID.
+  if i < 0 or i >= history.count:
+    raise newException(IndexDefect, "message history index out of bounds: " & $i)
+  history.entries[history.slot(i)].messageId
+
+proc `[]`*(history: MessageHistory, i: BackwardsIndex): SdsMessageID =
+  history[history.count - int(i)]
+
+proc encodeRecord(msgId: SdsMessageID, hint: openArray[byte]): seq[byte] =
+  ## Encodes a causal history entry as field 3 of an ``SdsMessage``.
+  var entryLen = lengthDelimitedFieldSize(1, msgId.len)
+  if hint.len > 0:
+    entryLen += lengthDelimitedFieldSize(2, hint.len)
+  result = newSeqOfCap[byte](lengthDelimitedFieldSize(3, entryLen))
+  result.appendLengthDelimitedHeader(3, entryLen)
+  result.appendStringField(1, msgId)
+  if hint.len > 0:
+    result.appendBytesField(2, hint)
+
+proc forget(history: var MessageHistory, msgId: SdsMessageID) =
+  var remaining = 0
+  history.index.withValue(msgId, entry):
+    entry.occurrences -= 1
+    remaining = entry.occurrences
+  if remaining == 0:
+    history.index.del(msgId)
+
+proc add*(history: var MessageHistory, msgId: SdsMessageID) =
+  ## Appends ``msgId`` as the most recent ID, evicting the oldest one if the
+  ## history is full, and slides the window over it.
+  if history.entries.len == 0:
+    return
+
+  if history.windowSize > 0 and not history.windowDirty and
+      history.count >= history.windowSize:
+    # The oldest record of the window leaves it
+    let leaving =
+      history.entries[history.slot(history.count - history.windowSize)].encoded.len
+    if leaving < history.window.len:
+      moveMem(addr history.window[0], addr history.window[leaving], history.window.len - leaving)
+    history.window.setLen(history.window.len - leaving)
+
+  var pos: int
+  if history.count == history.entries.len:
+    pos = history.slot(0)
+    history.forget(history.entries[pos].messageId)
+    history.head = (history.head + 1) mod history.entries.len
+  else:
+    pos = history.slot(history.count)
+    history.count += 1
+  history.entries[pos] =
+    HistoryRecord(messageId: msgId, encoded: encodeRecord(msgId, newSeq[byte]()))
+
+  if history.windowSize > 0 and not history.windowDirty:
+    history.window.add(history.entries[pos].encoded)
+
+  history.index.withValue(msgId, entry):
+    entry.occurrences += 1
+    entry.latest = pos
+  do:
+    history.index[msgId] = (occurrences: 1, latest: pos)
+
+proc setRetrievalHintAt(history: var MessageHistory, pos: int, hint: openArray[byte]) =
+  if hint.len == 0:
+    return # Not available yet, asked for again next time
+  let record = addr history.entries[pos]
+  record.retrievalHint = @hint
+  record.hintKnown = true
+  record.encoded = encodeRecord(record.messageId, hint)
+  if history.inWindow(pos):
+    history.windowDirty = true
+
+proc setRetrievalHint*(
+    history: var MessageHistory, msgId: SdsMessageID, hint: openArray[byte]
+): bool =
+  ## Caches ``hint`` for the most recent occurrence of ``msgId``, unless a hint
+  ## is known for it already. Returns whether the hint was recorded; empty
+  ## hints never are.
+  history.index.withValue(msgId, entry):
+    if hint.len > 0 and not history.entries[entry.latest].hintKnown:
+      history.setRetrievalHintAt(entry.latest, hint)
+      return true
+  false
+
+proc unknownHints*(history: MessageHistory, n: int): seq[SdsMessageID] =
+  ## Returns the IDs among the ``n`` most recent whose hint is not known yet,
+  ## to be asked for and recorded with ``setRetrievalHint``.
+  for i in max(0, history.count - n) ..< history.count:
+    let pos = history.slot(i)
+    if not history.entries[pos].hintKnown:
+      result.add(history.entries[pos].messageId)
+
+proc causalWindow*(history: var MessageHistory): lent seq[byte] =
+  ## Returns the window as causal history entries encoded as ``SdsMessage``
+  ## fields, ready to be spliced into an outgoing message.
+  if history.windowDirty:
+    history.window.setLen(0)
+    for i in max(0, history.count - history.windowSize) ..< history.count:
+      history.window.add(history.entries[history.slot(i)].encoded)
+    history.windowDirty = false
+  history.window
+
+proc clear*(history: var MessageHistory) =
+  for i in 0 ..< history.count:
+    history.entries[history.slot(i)] = HistoryRecord()
+  history.head = 0
+  history.count = 0
+  history.index.clear()
+  history.window.setLen(0)
+  history.windowDirty = false
+
+iterator items*(history: MessageHistory): SdsMessageID =
+  ## Yields the IDs from the oldest to the most recent.
+  for i in 0 ..< history.count:
+    yield history.entries[history.slot(i)].messageId
+
+iterator recent*(history: MessageHistory, n: int): SdsMessageID =
+  ## Yields the ``n`` most recent IDs, oldest first.
+  for i in max(0, history.count - n) ..< history.count:
+    yield history.entries[history.slot(i)].messageId
+
+iterator recentRecords*(history: MessageHistory, n: int): lent HistoryRecord =
+  ## Yields the records of the ``n`` most recent IDs, oldest first.
+  for i in max(0, history.count - n) ..< history.count:
+    yield history.entries[history.slot(i)]
+
+proc windowIds*(history: MessageHistory): seq[SdsMessageID] =
+  ## Returns the IDs of the window, oldest first.
+  result = newSeqOfCap[SdsMessageID](min(history.count, history.windowSize))
+  for msgId in history.recent(history.windowSize):
+    result.add(msgId)
@@ -0,0 +1,197 @@
+{.push raises: [].}
+
+import results
+import ./[message, protobufutil]
+
+type
+  ByteSpan* = object
+    ## Location of a field payload in the buffer a view was decoded from.
+    start*: int
+    len*: int
+
+  HistoryEntryView* = object
+    messageId*: ByteSpan
+    retrievalHint*: ByteSpan
+
+  SdsMessageView* = object
+    ## ``SdsMessage`` decoded in place: the variable-size fields are spans of
+    ## the wire buffer instead of copies. The buffer must outlive the view and
+    ## stay unchanged. Use ``toMessage`` to take ownership of the fields.
+    ##
+    ## Causal history entries are only located by ``decode``; they are checked
+    ## by ``validateHistory``, so that duplicates can be dropped first.
+    data*: ptr UncheckedArray[byte]
+    dataLen*: int
+    messageIdSpan*: ByteSpan
+    lamportTimestamp*: int64
+    channelIdSpan*: ByteSpan
+    contentSpan*: ByteSpan
+    bloomFilterSpan*: ByteSpan
+    historyLen*: int ## Number of causal history entries
+    historyStart*: int ## Range of the buffer holding the history entries
+    historyEnd*: int
+
+template bytes*(view: SdsMessageView, span: ByteSpan): untyped =
+  ## Borrows the bytes of ``span``.
+  toOpenArray(view.data, span.start, span.start + span.len - 1)
+
+proc toString*(view: SdsMessageView, span: ByteSpan): string =
+  result = newString(span.len)
+  if span.len > 0:
+    copyMem(addr result[0], addr view.data[span.start], span.len)
+
+proc toBytes*(view: SdsMessageView, span: ByteSpan): seq[byte] =
+  @(view.bytes(span))
+
+proc span(field: ProtoField): ByteSpan {.inline.} =
+  ByteSpan(start: field.start, len: field.len)
+
+proc decodeHistoryEntry(
+    data: openArray[byte], entry: ByteSpan, res: var HistoryEntryView
+): bool =
+  ## Locates the fields of the ``HistoryEntry`` encoded at ``entry``.
+  var
+    pos = entry.start
+    field: ProtoField
+    hasId = false
+  let entryEnd = entry.start + entry.len
+  res.retrievalHint = ByteSpan(start: entry.start, len: 0)
+  while pos < entryEnd:
+    if not data.toOpenArray(0, entryEnd - 1).readField(pos, field):
+      return false
+    if field.number in [1, 2] and field.wireType != WireLengthDelimited:
+      return false
+    if field.number == 1:
+      res.messageId = field.span
+      hasId = true
+    elif field.number == 2:
+      res.retrievalHint = field.span
+  hasId
+
+proc decode*(
+    T: type SdsMessageView, data: openArray[byte]
+): ProtobufResult[SdsMessageView] =
+  ## Decodes the fields of a serialized ``SdsMessage`` in a single pass,
+  ## without copying them. The same fields are required as by
+  ## ``SdsMessage.decode``.
+  if data.len == 0:
+    return err(ProtobufError.missingRequiredField("messageId"))
+
+  var
+    view = SdsMessageView(
+      data: cast[ptr UncheckedArray[byte]](unsafeAddr data[0]), dataLen: data.len
+    )
+    pos = 0
+    field: ProtoField
+    seen: set[0 .. 6]
+
+  while pos < data.len:
+    let fieldPos = pos
+    if not data.readField(pos, field):
+      return err(toProtobufError(ProtoError.MessageIncomplete))
+    if field.number > 6:
+      continue # Unknown fields are skipped, as by minprotobuf
+
+    let expected = if field.number == 2: WireVarint else: WireLengthDelimited
+    if field.wireType != expected:
+      return err(toProtobufError(ProtoError.BadWireType))
+
+    case field.number
+    of 1:
+      view.messageIdSpan = field.span
+    of 2:
+      view.lamportTimestamp = cast[int64](field.value)
+    of 3:
+      if view.historyLen == 0:
+        view.historyStart = fieldPos
+      view.historyEnd = pos
+      inc view.historyLen
+    of 4:
+      view.channelIdSpan = field.span
+    of 5:
+      view.contentSpan = field.span
+    of 6:
+      view.bloomFilterSpan = field.span
+    else:
+      discard
+    seen.incl(field.number)
+
+  if 1 notin seen:
+    return err(ProtobufError.missingRequiredField("messageId"))
+  if 2 notin seen:
+    return err(ProtobufError.missingRequiredField("lamportTimestamp"))
+  if 4 notin seen:
+    return err(ProtobufError.missingRequiredField("channelId"))
+  if 5 notin seen:
+    return err(ProtobufError.missingRequiredField("content"))
+
+  ok(view)
+
+proc messageId*(view: SdsMessageView): SdsMessageID =
+  view.toString(view.messageIdSpan)
+
+proc channelId*(view: SdsMessageView): SdsChannelID =
+  view.toString(view.channelIdSpan)
+
+proc content*(view: SdsMessageView): seq[byte] =
+  view.toBytes(view.contentSpan)
+
+proc validateHistory*(view: SdsMessageView): ProtobufResult[void] =
+  ## Checks that every causal history entry has a message ID.
+  var
+    pos = view.historyStart
+    field: ProtoField
+    entry: HistoryEntryView
+  while pos < view.historyEnd:
+    discard view.data.toOpenArray(0, view.historyEnd - 1).readField(pos, field)
+    if field.number == 3 and
+        not view.data.toOpenArray(0, view.historyEnd - 1).decodeHistoryEntry(
+          field.span, entry
+        ):
+      return err(ProtobufError.missingRequiredField("HistoryEntry.messageId"))
+  ok()
+
+iterator history*(view: SdsMessageView): HistoryEntryView =
+  ## Yields the causal history entries, in wire order. Entries that do not
+  ## pass ``validateHistory`` are skipped.
+  var
+    pos = view.historyStart
+    field: ProtoField
+    entry: HistoryEntryView
+  while pos < view.historyEnd:
+    discard view.data.toOpenArray(0, view.historyEnd - 1).readField(pos, field)
+    if field.number == 3 and
+        view.data.toOpenArray(0, view.historyEnd - 1).decodeHistoryEntry(
+          field.span, entry
+        ):
+      yield entry
+
+proc toHistoryEntry*(view: SdsMessageView, entry: HistoryEntryView): HistoryEntry =
+  HistoryEntry(
+    messageId: view.toString(entry.messageId),
+    retrievalHint: view.toBytes(entry.retrievalHint),
+  )
+
+proc toMessage*(view: SdsMessageView): SdsMessage =
+  ## Copies the viewed fields into an ``SdsMessage`` that owns them.
+  result = SdsMessage(
+    messageId: view.messageId,
+    lamportTimestamp: view.lamportTimestamp,
+    causalHistory: newSeqOfCap[HistoryEntry](view.historyLen),
+    channelId: view.channelId,
+    content: view.content,
+    bloomFilter: view.toBytes(view.bloomFilterSpan),
+  )
+  for entry in view.history:
+    result.causalHistory.add(view.toHistoryEntry(entry))
+
+proc toRetained*(view: SdsMessageView): RetainedMessage =
+  ## Copies what the buffers keep of the viewed message, see ``RetainedMessage``.
+  result = RetainedMessage(
+    messageId: view.messageId,
+    lamportTimestamp: view.lamportTimestamp,
+    causalHistory: newSeqOfCap[SdsMessageID](view.historyLen),
+    content: view.content,
+  )
+  for entry in view.history:
+    result.causalHistory.add(view.toString(entry.messageId))
@@ -0,0 +1,89 @@
+#
+# ### MurmurHash3 (x64, 128-bit variant), in private/ for readability ###
+# Reference: https://github.com/aappleby/smhasher/blob/master/src/MurmurHash3.cpp
+# Blocks are always read as little-endian so the output does not depend on the
+# host byte order, word size or Nim version.
+#
+
+const
+  C1 = 0x87c37b91114253d5'u64
+  C2 = 0x4cf5ad432745937f'u64
+
+func rotl64(x: uint64, r: int): uint64 {.inline.} =
+  (x shl r) or (x shr (64 - r))
+
+func fmix64(k: uint64): uint64 {.inline.} =
+  var k = k
+  k = k xor (k shr 33)
+  k = k * 0xff51afd7ed558ccd'u64
+  k = k xor (k shr 33)
+  k = k * 0xc4ceb9fe1a85ec53'u64
+  k xor (k shr 33)
+
+func loadLE64(data: openArray[byte], offset: int): uint64 {.inline.} =
+  for i in countdown(7, 0):
+    result = (result shl 8) or uint64(data[offset + i])
+
+func murmurHash3x64_128*(
+    data: openArray[byte], seed = 0'u64
+): tuple[h1, h2: uint64] =
+  ## Computes the 128-bit MurmurHash3 of ``data``, returned as its two 64-bit halves.
+  let nBlocks = data.len div 16
+  var
+    h1 = seed
+    h2 = seed
+
+  for i in 0 ..< nBlocks:
+    var
+      k1 = loadLE64(data, i * 16)
+      k2 = loadLE64(data, i * 16 + 8)
+
+    k1 = k1 * C1
+    k1 = rotl64(k1, 31)
+    k1 = k1 * C2
+    h1 = h1 xor k1
+    h1 = rotl64(h1, 27)
+    h1 = h1 + h2
+    h1 = h1 * 5 + 0x52dce729'u64
+
+    k2 = k2 * C2
+    k2 = rotl64(k2, 33)
+    k2 = k2 * C1
+    h2 = h2 xor k2
+    h2 = rotl64(h2, 31)
+    h2 = h2 + h1
+    h2 = h2 * 5 + 0x38495ab5'u64
+
+  let
+    tail = nBlocks * 16
+    rem = data.len and 15
+  var
+    k1 = 0'u64
+    k2 = 0'u64
+
+  if rem > 8:
+    for i in countdown(rem - 1, 8):
+      k2 = k2 xor (uint64(data[tail + i]) shl ((i - 8) * 8))
+    k2 = k2 * C2
+    k2 = rotl64(k2, 33)
+    k2 = k2 * C1
+    h2 = h2 xor k2
+
+  if rem > 0:
+    for i in countdown(min(rem, 8) - 1, 0):
+      k1 = k1 xor (uint64(data[tail + i]) shl (i * 8))
+    k1 = k1 * C1
+    k1 = rotl64(k1, 31)
+    k1 = k1 * C2
+    h1 = h1 xor k1
+
+  h1 = h1 xor uint64(data.len)
+  h2 = h2 xor uint64(data.len)
+  h1 = h1 + h2
+  h2 = h2 + h1
+  h1 = fmix64(h1)
+  h2 = fmix64(h2)
+  h1 = h1 + h2
+  h2 = h2 + h1
+
+  (h1, h2)
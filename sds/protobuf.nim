@@ -1,12 +1,12 @@
 import libp2p/protobuf/minprotobuf
-import endians
-import sds/[message, protobufutil, bloom, sds_utils]
+import std/[endians, bitops, algorithm]
+import sds/[message, message_view, protobufutil, bloom, sds_utils]
 
 proc encode*(msg: SdsMessage): ProtoBuffer =
   var pb = initProtoBuffer()
 
   pb.write(1, msg.messageId)
-  pb.write(2, uint64(msg.lamportTimestamp))
+  pb.write(2, cast[uint64](msg.lamportTimestamp))
 
   for entry in msg.causalHistory:
     var entryPb = initProtoBuffer()
@@ -33,7 +33,7 @@ proc decode*(T: type SdsMessage, buffer: seq[byte]): ProtobufResult[T] =
   var timestamp: uint64
   if not ?pb.getField(2, timestamp):
     return err(ProtobufError.missingRequiredField("lamportTimestamp"))
-  msg.lamportTimestamp = int64(timestamp)
+  msg.lamportTimestamp = cast[int64](timestamp)
 
   # Handle both old and new causal history formats
   var historyBuffers: seq[seq[byte]]
@@ -65,63 +65,218 @@ proc decode*(T: type SdsMessage, buffer: seq[byte]): ProtobufResult[T] =
 
   ok(msg)
 
-proc extractChannelId*(data: seq[byte]): Result[SdsChannelID, ReliabilityError] =
+func historyEntryLen(entry: HistoryEntry): int =
+  ## Payload length of an encoded ``HistoryEntry``.
+  result = lengthDelimitedFieldSize(1, entry.messageId.len)
+  if entry.retrievalHint.len > 0:
+    result += lengthDelimitedFieldSize(2, entry.retrievalHint.len)
+
+func encodedSize*(causalHistory: seq[HistoryEntry]): int =
+  ## Exact size of ``causalHistory`` encoded as message fields.
+  for entry in causalHistory:
+    result += lengthDelimitedFieldSize(3, historyEntryLen(entry))
+
+func encodedSize*(msg: SdsMessage, encodedCausalHistoryLen: int): int =
+  ## Exact serialized size of ``msg`` with a causal history already encoded in
+  ## ``encodedCausalHistoryLen`` bytes.
+  lengthDelimitedFieldSize(1, msg.messageId.len) +
+    varintFieldSize(2, cast[uint64](msg.lamportTimestamp)) + encodedCausalHistoryLen +
+    lengthDelimitedFieldSize(4, msg.channelId.len) +
+    lengthDelimitedFieldSize(5, msg.content.len) +
+    lengthDelimitedFieldSize(6, msg.bloomFilter.len)
+
+func encodedSize*(msg: SdsMessage): int =
+  ## Exact serialized size of ``msg``.
+  msg.encodedSize(encodedSize(msg.causalHistory))
+
+proc writeCausalHistory(
+    buf: var openArray[byte], pos: var int, causalHistory: seq[HistoryEntry]
+) =
+  for entry in causalHistory:
+    buf.writeLengthDelimitedHeader(pos, 3, historyEntryLen(entry))
+    buf.writeStringField(pos, 1, entry.messageId)
+    if entry.retrievalHint.len > 0:
+      buf.writeBytesField(pos, 2, entry.retrievalHint)
+
+proc encodeCausalHistory*(causalHistory: seq[HistoryEntry]): seq[byte] =
+  ## Encodes ``causalHistory`` as the repeated field 3 records of an ``SdsMessage``,
+  ## ready to be spliced into a message by ``serializeMessage``.
+  result = newSeqUninit[byte](encodedSize(causalHistory))
+  var pos = 0
+  result.writeCausalHistory(pos, causalHistory)
+
+template writeMessage(
+    output: var openArray[byte], msg: SdsMessage, size: int, writeHistory: untyped
+): Result[int, ReliabilityError] =
+  if output.len < size:
+    err(ReliabilityError.reSerializationError)
+  else:
+    var pos {.inject.} = 0
+    output.writeStringField(pos, 1, msg.messageId)
+    output.writeVarintField(pos, 2, cast[uint64](msg.lamportTimestamp))
+    writeHistory
+    output.writeStringField(pos, 4, msg.channelId)
+    output.writeBytesField(pos, 5, msg.content)
+    output.writeBytesField(pos, 6, msg.bloomFilter)
+    ok(pos)
+
+proc encodeInto*(
+    msg: SdsMessage, output: var openArray[byte]
+): Result[int, ReliabilityError] =
+  ## Serializes ``msg`` into the start of ``output`` in a single pass and
+  ## returns the number of bytes written, ``msg.encodedSize()``. Fails if
+  ## ``output`` is too small. The bytes are the same as ``serializeMessage(msg)``.
+  writeMessage(output, msg, msg.encodedSize()):
+    output.writeCausalHistory(pos, msg.causalHistory)
+
+proc encodeInto*(
+    msg: SdsMessage, encodedCausalHistory: openArray[byte], output: var openArray[byte]
+): Result[int, ReliabilityError] =
+  ## Like ``encodeInto`` but splices an already encoded causal history (see
+  ## ``encodeCausalHistory``) instead of encoding ``msg.causalHistory``.
+  writeMessage(output, msg, msg.encodedSize(encodedCausalHistory.len)):
+    output.writeBytes(pos, encodedCausalHistory)
+
+proc extractChannelId*(data: openArray[byte]): Result[SdsChannelID, ReliabilityError] =
   ## For extraction of channel ID without full message deserialization
-  try:
-    let pb = initProtoBuffer(data)
-    var channelId: SdsChannelID
-    let fieldOk = pb.getField(4, channelId).valueOr:
-      return err(ReliabilityError.reDeserializationError)
-    if not fieldOk:
-      return err(ReliabilityError.reDeserializationError)
-    ok(channelId)
-  except:
-    err(ReliabilityError.reDeserializationError)
+  let view = SdsMessageView.decode(data).valueOr:
+    return err(ReliabilityError.reDeserializationError)
+  ok(view.channelId)
 
 proc serializeMessage*(msg: SdsMessage): Result[seq[byte], ReliabilityError] =
-  let pb = encode(msg)
-  ok(pb.buffer)
+  var buf = newSeqUninit[byte](msg.encodedSize())
+  discard ?msg.encodeInto(buf)
+  ok(buf)
+
+proc serializeMessage*(
+    msg: SdsMessage, encodedCausalHistory: openArray[byte], output: var seq[byte]
+): Result[void, ReliabilityError] =
+  ## Serializes ``msg`` into ``output``, reusing its memory when it is already
+  ## large enough, with an already encoded causal history (see
+  ## ``encodeCausalHistory``).
+  output.setLen(msg.encodedSize(encodedCausalHistory.len))
+  discard ?msg.encodeInto(encodedCausalHistory, output)
+  ok()
+
+proc serializeMessage*(
+    msg: SdsMessage, encodedCausalHistory: openArray[byte]
+): Result[seq[byte], ReliabilityError] =
+  ## Serializes ``msg`` using an already encoded causal history (see
+  ## ``encodeCausalHistory``) instead of encoding ``msg.causalHistory`` again.
+  ## The output is identical to ``serializeMessage(msg)``.
+  var buf: seq[byte]
+  ?msg.serializeMessage(encodedCausalHistory, buf)
+  ok(buf)
 
 proc deserializeMessage*(data: seq[byte]): Result[SdsMessage, ReliabilityError] =
   let msg = SdsMessage.decode(data).valueOr:
     return err(ReliabilityError.reDeserializationError)
   ok(msg)
 
-proc serializeBloomFilter*(filter: BloomFilter): Result[seq[byte], ReliabilityError] =
+type BloomFilterEncoding* {.pure.} = enum
+  Raw ## Little-endian 64-bit words of the bit array, the original format
+  Sparse ## Varint gaps between the set bits, used while the filter is mostly empty
+
+proc encodeSparseBits(intArray: seq[int], limit: int, bits: var seq[byte]): bool =
+  ## Encodes the positions of the set bits as varint gaps into ``bits``.
+  ## Gives up and returns false as soon as the encoding reaches ``limit`` bytes.
+  var prev = -1
+  for i, word in intArray:
+    var remaining = cast[uint64](word)
+    while remaining != 0:
+      let pos = i * 64 + countTrailingZeroBits(remaining)
+      bits.appendVarint(uint64(pos - prev - 1))
+      if bits.len >= limit:
+        return false
+      prev = pos
+      remaining = remaining and (remaining - 1)
+  true
+
+proc decodeSparseBits(bits: seq[byte], mBits: int, intArray: var seq[int]): bool =
+  ## Sets the bits listed by an ``encodeSparseBits`` payload in ``intArray``.
+  var
+    pos = 0
+    bitIdx = -1
+  while pos < bits.len:
+    var gap: uint64
+    if not readVarint(bits, pos, gap) or gap >= uint64(mBits):
+      return false
+    bitIdx += int(gap) + 1
+    if bitIdx >= mBits:
+      return false
+    intArray[bitIdx div 64] = intArray[bitIdx div 64] or (1 shl (bitIdx mod 64))
+  true
+
+proc serializeBloomFilter*(
+    filter: BloomFilter, rawStart: var int
+): Result[seq[byte], ReliabilityError] =
+  ## Serializes ``filter`` for the wire. The set bits are sent as a sparse list
+  ## whenever that is smaller than the raw bit array, which is the case until
+  ## the filter is roughly an eighth full.
+  ##
+  ## ``rawStart`` is set to the position of the raw bit array in the result,
+  ## for ``patchRawBits``, or to -1 if the bits are sparse.
   var pb = initProtoBuffer()
+  rawStart = -1
 
-  # Convert intArray to bytes
   try:
-    var bytes = newSeq[byte](filter.intArray.len * sizeof(int))
-    for i, val in filter.intArray:
-      var leVal: int
-      littleEndian64(addr leVal, unsafeAddr val)
-      let start = i * sizeof(int)
-      copyMem(addr bytes[start], addr leVal, sizeof(int))
-
-    pb.write(1, bytes)
+    let rawLen = filter.intArray.len * sizeof(int)
+    var sparse: seq[byte]
+    if encodeSparseBits(filter.intArray, rawLen, sparse):
+      pb.write(7, uint64(ord(BloomFilterEncoding.Sparse)))
+      pb.write(8, sparse)
+    else:
+      # Convert intArray to bytes
+      var bytes = newSeq[byte](rawLen)
+      for i, val in filter.intArray:
+        var leVal: int
+        littleEndian64(addr leVal, unsafeAddr val)
+        let start = i * sizeof(int)
+        copyMem(addr bytes[start], addr leVal, sizeof(int))
+      pb.write(1, bytes)
+      rawStart = pb.buffer.len - rawLen
+
     pb.write(2, uint64(filter.capacity))
     pb.write(3, uint64(filter.errorRate * 1_000_000))
     pb.write(4, uint64(filter.kHashes))
     pb.write(5, uint64(filter.mBits))
+    if filter.kind != BloomFilterKind.Standard:
+      pb.write(6, uint64(ord(filter.kind)))
   except:
     return err(ReliabilityError.reSerializationError)
 
   pb.finish()
   ok(pb.buffer)
 
-proc deserializeBloomFilter*(data: seq[byte]): Result[BloomFilter, ReliabilityError] =
+proc serializeBloomFilter*(filter: BloomFilter): Result[seq[byte], ReliabilityError] =
+  var rawStart: int
+  serializeBloomFilter(filter, rawStart)
+
+proc validFilterShape(
+    capacity, kHashes, mBits: uint64, kind: BloomFilterKind
+): bool =
+  ## Whether the parameters of a received filter are safe to probe with. A
+  ## raw filter has to fit in a message, so larger sparse ones are bogus, and
+  ## a filter without hash functions would contain everything.
+  mBits > 0 and mBits <= uint64(MaxMessageSize) * 8 and
+    (kind != BloomFilterKind.Blocked or mBits mod uint64(BlockBits) == 0) and
+    kHashes >= 1 and kHashes <= min(uint64(MaxHashes), mBits) and
+    capacity <= uint64(high(int))
+
+proc deserializeBloomFilter*(
+    data: openArray[byte]
+): Result[BloomFilter, ReliabilityError] =
+  ## Deserializes a filter written by ``serializeBloomFilter``, in either the
+  ## raw or the sparse encoding.
   if data.len == 0:
     return err(ReliabilityError.reDeserializationError)
 
   let pb = initProtoBuffer(data)
   var bytes: seq[byte]
-  var cap, errRate, kHashes, mBits: uint64
+  var cap, errRate, kHashes, mBits, kind, encoding: uint64
 
   try:
     let
-      field1_Ok = pb.getField(1, bytes).valueOr:
-        return err(ReliabilityError.reDeserializationError)
       field2_Ok = pb.getField(2, cap).valueOr:
         return err(ReliabilityError.reDeserializationError)
       field3_Ok = pb.getField(3, errRate).valueOr:
@@ -131,16 +286,46 @@ proc deserializeBloomFilter*(data: seq[byte]): Result[BloomFilter, ReliabilityEr
       field5_Ok = pb.getField(5, mBits).valueOr:
         return err(ReliabilityError.reDeserializationError)
 
-    if not field1_Ok or not field2_Ok or not field3_Ok or not field4_Ok or not field5_Ok:
+    if not field2_Ok or not field3_Ok or not field4_Ok or not field5_Ok:
       return err(ReliabilityError.reDeserializationError)
 
-    # Convert bytes back to intArray
-    var intArray = newSeq[int](bytes.len div sizeof(int))
-    for i in 0 ..< intArray.len:
-      var leVal: int
-      let start = i * sizeof(int)
-      copyMem(addr leVal, unsafeAddr bytes[start], sizeof(int))
-      littleEndian64(addr intArray[i], addr leVal)
+    # kind and encoding are optional, filters from older peers are always
+    # standard and raw
+    discard pb.getField(6, kind)
+    discard pb.getField(7, encoding)
+    if kind > uint64(ord(high(BloomFilterKind))) or
+        encoding > uint64(ord(high(BloomFilterEncoding))):
+      return err(ReliabilityError.reDeserializationError)
+
+    let filterKind = BloomFilterKind(kind)
+    if not validFilterShape(cap, kHashes, mBits, filterKind):
+      return err(ReliabilityError.reDeserializationError)
+
+    var intArray: seq[int]
+    case BloomFilterEncoding(encoding)
+    of BloomFilterEncoding.Raw:
+      let bytesOk = pb.getField(1, bytes).valueOr:
+        return err(ReliabilityError.reDeserializationError)
+      if not bytesOk:
+        return err(ReliabilityError.reDeserializationError)
+
+      # Convert bytes back to intArray
+      intArray = newSeq[int](bytes.len div sizeof(int))
+      for i in 0 ..< intArray.len:
+        var leVal: int
+        let start = i * sizeof(int)
+        copyMem(addr leVal, unsafeAddr bytes[start], sizeof(int))
+        littleEndian64(addr intArray[i], addr leVal)
+    of BloomFilterEncoding.Sparse:
+      # An empty filter may come without any bit positions at all
+      discard pb.getField(8, bytes)
+      intArray = newSeq[int](intArrayLen(int(mBits), filterKind))
+      if not decodeSparseBits(bytes, int(mBits), intArray):
+        return err(ReliabilityError.reDeserializationError)
+
+    # Reject parameters that would make probes fall outside the bit array
+    if mBits > uint64(intArray.len * sizeof(int) * 8):
+      return err(ReliabilityError.reDeserializationError)
 
     ok(
       BloomFilter(
@@ -149,7 +334,114 @@ proc deserializeBloomFilter*(data: seq[byte]): Result[BloomFilter, ReliabilityEr
         errorRate: float(errRate) / 1_000_000,
         kHashes: int(kHashes),
         mBits: int(mBits),
+        kind: filterKind,
       )
     )
   except:
     return err(ReliabilityError.reDeserializationError)
+
+type BloomFilterView* = object
+  ## Serialized bloom filter probed in place. Raw bits are read from the wire
+  ## buffer, which must outlive the view; sparse ones are kept as the sorted
+  ## list of set bit positions.
+  shape*: BloomFilter ## Parameters of the filter, with an empty ``intArray``
+  encoding*: BloomFilterEncoding
+  rawBits: ptr UncheckedArray[byte]
+  setBits: seq[int]
+
+proc decodeBloomFilterView*(
+    data: openArray[byte]
+): Result[BloomFilterView, ReliabilityError] =
+  ## Decodes a filter written by ``serializeBloomFilter`` without expanding
+  ## its bit array. Accepts the same input as ``deserializeBloomFilter``.
+  var
+    pos = 0
+    field: ProtoField
+    params: array[2 .. 7, uint64]
+    seen: set[1 .. 8]
+    raw, sparse: ProtoField
+
+  while pos < data.len:
+    if not data.readField(pos, field):
+      return err(ReliabilityError.reDeserializationError)
+    case field.number
+    of 1, 8:
+      if field.wireType != WireLengthDelimited:
+        return err(ReliabilityError.reDeserializationError)
+      if field.number == 1:
+        raw = field
+      else:
+        sparse = field
+    of 2 .. 7:
+      if field.wireType != WireVarint:
+        return err(ReliabilityError.reDeserializationError)
+      params[field.number] = field.value
+    else:
+      continue
+    seen.incl(field.number)
+
+  for required in 2 .. 5:
+    if required notin seen:
+      return err(ReliabilityError.reDeserializationError)
+  # kind and encoding are optional, filters from older peers are always
+  # standard and raw
+  if params[6] > uint64(ord(high(BloomFilterKind))) or
+      params[7] > uint64(ord(high(BloomFilterEncoding))):
+    return err(ReliabilityError.reDeserializationError)
+
+  let
+    mBits = params[5]
+    kind = BloomFilterKind(params[6])
+  if not validFilterShape(params[2], params[4], mBits, kind):
+    return err(ReliabilityError.reDeserializationError)
+
+  var view = BloomFilterView(
+    shape: BloomFilter(
+      capacity: int(params[2]),
+      errorRate: float(params[3]) / 1_000_000,
+      kHashes: int(params[4]),
+      mBits: int(mBits),
+      kind: kind,
+    ),
+    encoding: BloomFilterEncoding(params[7]),
+  )
+
+  case view.encoding
+  of BloomFilterEncoding.Raw:
+    # Only whole 64-bit words count, as when expanding into ``intArray``
+    if 1 notin seen or mBits > uint64(raw.len div 8) * 64:
+      return err(ReliabilityError.reDeserializationError)
+    view.rawBits = cast[ptr UncheckedArray[byte]](unsafeAddr data[raw.start])
+  of BloomFilterEncoding.Sparse:
+    # An empty filter may come without any bit positions at all
+    let sparseEnd = sparse.start + sparse.len
+    var
+      bitPos = sparse.start
+      bitIdx = -1
+    while bitPos < sparseEnd:
+      var gap: uint64
+      if not data.toOpenArray(0, sparseEnd - 1).readVarint(bitPos, gap) or
+          gap >= mBits:
+        return err(ReliabilityError.reDeserializationError)
+      bitIdx += int(gap) + 1
+      if bitIdx >= int(mBits):
+        return err(ReliabilityError.reDeserializationError)
+      view.setBits.add(bitIdx)
+
+  ok(view)
+
+proc lookup*(view: BloomFilterView, digest: BloomDigest): bool =
+  ## Looks an item, given by its ``bloomDigest``, up in the serialized filter.
+  ## Raw bits are tested straight from the little-endian wire bytes: bit ``b``
+  ## of the filter is bit ``b mod 8`` of byte ``b div 8``.
+  case view.encoding
+  of BloomFilterEncoding.Raw:
+    for b in view.shape.bitIndexes(digest):
+      if ((view.rawBits[b shr 3] shr (b and 7)) and 1) == 0:
+        return false
+    true
+  of BloomFilterEncoding.Sparse:
+    for b in view.shape.bitIndexes(digest):
+      if view.setBits.binarySearch(b) < 0:
+        return false
+    true
@@ -30,3 +30,146 @@ converter toProtobufError*(err: minprotobuf.ProtoError): ProtobufError =
 
 proc missingRequiredField*(T: type ProtobufError, field: string): T =
   ProtobufError(kind: ProtobufErrorKind.MissingRequiredField, field: field)
+
+func varintSize*(value: uint64): int =
+  ## Number of bytes ``value`` takes as a protobuf (LEB128) varint.
+  result = 1
+  var v = value shr 7
+  while v != 0:
+    inc result
+    v = v shr 7
+
+proc appendVarint*(buf: var seq[byte], value: uint64) =
+  ## Appends ``value`` to ``buf`` as a protobuf (LEB128) varint.
+  var v = value
+  while v >= 0x80'u64:
+    buf.add(byte(v and 0x7f) or 0x80'u8)
+    v = v shr 7
+  buf.add(byte(v))
+
+proc readVarint*(buf: openArray[byte], pos: var int, value: var uint64): bool =
+  ## Reads a protobuf (LEB128) varint starting at ``pos`` and advances ``pos``
+  ## past it. Returns false on truncated or overlong input.
+  value = 0
+  var shift = 0
+  while pos < buf.len and shift < 64:
+    let b = buf[pos]
+    inc pos
+    value = value or (uint64(b and 0x7f'u8) shl shift)
+    if (b and 0x80'u8) == 0:
+      return true
+    shift += 7
+  false
+
+const
+  WireVarint* = 0'u64
+  WireFixed64* = 1'u64
+  WireLengthDelimited* = 2'u64
+  WireFixed32* = 5'u64
+
+type ProtoField* = object
+  ## A field read by ``readField``. ``value`` holds varint and fixed values,
+  ## ``start`` and ``len`` locate the payload of a length-delimited field in
+  ## the buffer it was read from.
+  number*: int
+  wireType*: uint64
+  value*: uint64
+  start*: int
+  len*: int
+
+proc readField*(buf: openArray[byte], pos: var int, field: var ProtoField): bool =
+  ## Reads the field starting at ``pos`` and advances ``pos`` past it, without
+  ## copying its payload. Returns false on malformed or truncated input.
+  var key: uint64
+  if not readVarint(buf, pos, key) or (key shr 3) == 0 or (key shr 3) > uint64(high(int32)):
+    return false
+  field.number = int(key shr 3)
+  field.wireType = key and 7
+  field.value = 0
+  field.start = pos
+  field.len = 0
+
+  case field.wireType
+  of WireVarint:
+    readVarint(buf, pos, field.value)
+  of WireFixed64, WireFixed32:
+    let size = if field.wireType == WireFixed64: 8 else: 4
+    if buf.len - pos < size:
+      return false
+    for i in countdown(size - 1, 0):
+      field.value = (field.value shl 8) or uint64(buf[pos + i])
+    pos += size
+    true
+  of WireLengthDelimited:
+    var len: uint64
+    if not readVarint(buf, pos, len) or len > uint64(buf.len - pos):
+      return false
+    field.start = pos
+    field.len = int(len)
+    pos += field.len
+    true
+  else:
+    false
+
+func varintFieldSize*(field: int, value: uint64): int =
+  ## Encoded size of a varint field, header included.
+  varintSize(uint64(field) shl 3) + varintSize(value)
+
+func lengthDelimitedFieldSize*(field: int, len: int): int =
+  ## Encoded size of a length-delimited field of ``len`` bytes, header included.
+  varintSize((uint64(field) shl 3) or WireLengthDelimited) + varintSize(uint64(len)) + len
+
+proc appendVarintField*(buf: var seq[byte], field: int, value: uint64) =
+  ## Appends a varint field, as ``minprotobuf.write`` does for ``uint64``.
+  buf.appendVarint((uint64(field) shl 3) or WireVarint)
+  buf.appendVarint(value)
+
+proc appendLengthDelimitedHeader*(buf: var seq[byte], field: int, len: int) =
+  ## Appends the header of a length-delimited field, the caller appends the
+  ## ``len`` bytes of payload.
+  buf.appendVarint((uint64(field) shl 3) or WireLengthDelimited)
+  buf.appendVarint(uint64(len))
+
+proc appendBytesField*(buf: var seq[byte], field: int, value: openArray[byte]) =
+  ## Appends a length-delimited field holding ``value``.
+  buf.appendLengthDelimitedHeader(field, value.len)
+  buf.add(value)
+
+proc appendStringField*(buf: var seq[byte], field: int, value: string) =
+  ## Appends a length-delimited field holding the bytes of ``value``.
+  buf.appendBytesField(field, value.toOpenArrayByte(0, value.high))
+
+proc writeVarint*(buf: var openArray[byte], pos: var int, value: uint64) =
+  ## Writes ``value`` as a varint at ``pos`` and advances ``pos`` past it. The
+  ## caller makes sure ``buf`` is large enough, see ``varintSize``.
+  var v = value
+  while v >= 0x80'u64:
+    buf[pos] = byte(v and 0x7f) or 0x80'u8
+    inc pos
+    v = v shr 7
+  buf[pos] = byte(v)
+  inc pos
+
+proc writeBytes*(buf: var openArray[byte], pos: var int, value: openArray[byte]) =
+  if value.len > 0:
+    copyMem(addr buf[pos], unsafeAddr value[0], value.len)
+    pos += value.len
+
+proc writeVarintField*(buf: var openArray[byte], pos: var int, field: int, value: uint64) =
+  buf.writeVarint(pos, (uint64(field) shl 3) or WireVarint)
+  buf.writeVarint(pos, value)
+
+proc writeLengthDelimitedHeader*(
+    buf: var openArray[byte], pos: var int, field: int, len: int
+) =
+  buf.writeVarint(pos, (uint64(field) shl 3) or WireLengthDelimited)
+  buf.writeVarint(pos, uint64(len))
+
+proc writeBytesField*(
+    buf: var openArray[byte], pos: var int, field: int, value: openArray[byte]
+) =
+  buf.writeLengthDelimitedHeader(pos, field, value.len)
+  buf.writeBytes(pos, value)
+
+proc writeStringField*(buf: var openArray[byte], pos: var int, field: int, value: string) =
+  buf.writeBytesField(pos, field, value.toOpenArrayByte(0, value.high))
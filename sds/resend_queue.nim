@@ -0,0 +1,48 @@
+import std/[times, heapqueue]
+import ./message
+
+type
+  ResendDeadline* = object
+    deadline*: Time
+    channelId*: SdsChannelID
+    messageId*: SdsMessageID
+
+  ResendQueue* = object
+    ## Min-heap of the next resend deadline of every unacknowledged message.
+    ## Acknowledged or rescheduled messages are not removed eagerly: their
+    ## entries are dropped once they reach the top and no longer match the
+    ## outgoing buffer.
+    heap: HeapQueue[ResendDeadline]
+
+proc `<`*(a, b: ResendDeadline): bool =
+  a.deadline < b.deadline
+
+proc initResendQueue*(): ResendQueue =
+  ResendQueue(heap: initHeapQueue[ResendDeadline]())
+
+proc len*(queue: ResendQueue): int =
+  queue.heap.len
+
+proc schedule*(
+    queue: var ResendQueue,
+    deadline: Time,
+    channelId: SdsChannelID,
+    messageId: SdsMessageID,
+) =
+  queue.heap.push(
+    ResendDeadline(deadline: deadline, channelId: channelId, messageId: messageId)
+  )
+
+proc nextDeadline*(queue: ResendQueue): Time =
+  ## Returns the earliest scheduled deadline. The queue must not be empty.
+  queue.heap[0].deadline
+
+proc popExpired*(queue: var ResendQueue, now: Time, due: var ResendDeadline): bool =
+  ## Pops into ``due`` the earliest entry if its deadline is before ``now``.
+  if queue.heap.len == 0 or queue.heap[0].deadline >= now:
+    return false
+  due = queue.heap.pop()
+  true
+
+proc clear*(queue: var ResendQueue) =
+  queue.heap.clear()
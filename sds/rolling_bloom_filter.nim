@@ -3,109 +3,127 @@ import chronicles
 import ./[bloom, message]
 
 type RollingBloomFilter* = object
+  ## Bloom filter that forgets old message IDs in two generations: IDs go to
+  ## the active generation and, once it holds ``maxCapacity div 2`` IDs, the
+  ## previous generation is dropped and the active one becomes the aging one.
+  ## ``filter`` is the union of both generations, so lookups and the wire
+  ## format stay a single filter and no ID is ever re-hashed.
+  ##
+  ## Right after a rotation only the last ``maxCapacity div 2`` IDs are
+  ## remembered, so the acknowledgement window ranges from half to all of
+  ## ``maxCapacity``.
   filter*: BloomFilter
+  current*: BloomFilter ## Active generation only
+  currentCount*: int ## IDs added to the active generation
   capacity*: int
-  minCapacity*: int
   maxCapacity*: int
-  messages*: seq[SdsMessageID]
+  dirty*: bool
+    ## Set when the filter bits changed other than by ``add`` inserting one
+    ## digest, that is on creation and rotation, so owners caching a
+    ## serialized copy know when to serialize it again. Inserts are left to
+    ## the owners to patch in. Cleared by the owner.
 
 const
   DefaultBloomFilterCapacity* = 10000
   DefaultBloomFilterErrorRate* = 0.001
   CapacityFlexPercent* = 20
 
+proc flexCapacity(capacity: int): int =
+  (capacity.float * (100 + CapacityFlexPercent).float / 100.0).int
+
 proc newRollingBloomFilter*(
     capacity: int = DefaultBloomFilterCapacity,
     errorRate: float = DefaultBloomFilterErrorRate,
+    kind: BloomFilterKind = BloomFilterKind.Standard,
 ): RollingBloomFilter {.gcsafe.} =
+  ## The bit arrays are sized for ``maxCapacity`` IDs, the most the union
+  ## holds, so that its false positive rate stays under ``errorRate``.
   let targetCapacity = if capacity <= 0: DefaultBloomFilterCapacity else: capacity
   let targetError =
     if errorRate <= 0.0 or errorRate >= 1.0: DefaultBloomFilterErrorRate else: errorRate
 
-  let filterResult = initializeBloomFilter(targetCapacity, targetError)
+  let maxCapacity = flexCapacity(targetCapacity)
+  let filterResult = initializeBloomFilter(maxCapacity, targetError, kind = kind)
   if filterResult.isErr:
     error "Failed to initialize bloom filter", error = filterResult.error
     # Try with default values if custom values failed
     if capacity != DefaultBloomFilterCapacity or errorRate != DefaultBloomFilterErrorRate:
+      let maxCapacity = flexCapacity(DefaultBloomFilterCapacity)
       let defaultResult =
-        initializeBloomFilter(DefaultBloomFilterCapacity, DefaultBloomFilterErrorRate)
+        initializeBloomFilter(maxCapacity, DefaultBloomFilterErrorRate, kind = kind)
       if defaultResult.isErr:
         error "Failed to initialize bloom filter with default parameters",
           error = defaultResult.error
 
-      let minCapacity = (
-        DefaultBloomFilterCapacity.float * (100 - CapacityFlexPercent).float / 100.0
-      ).int
-      let maxCapacity = (
-        DefaultBloomFilterCapacity.float * (100 + CapacityFlexPercent).float / 100.0
-      ).int
-
       info "Successfully initialized bloom filter with default parameters",
-        capacity = DefaultBloomFilterCapacity,
-        minCapacity = minCapacity,
-        maxCapacity = maxCapacity
+        capacity = DefaultBloomFilterCapacity, maxCapacity = maxCapacity
 
       return RollingBloomFilter(
         filter: defaultResult.get(),
+        current: defaultResult.get(),
         capacity: DefaultBloomFilterCapacity,
-        minCapacity: minCapacity,
         maxCapacity: maxCapacity,
-        messages: @[],
+        dirty: true,
       )
     else:
       error "Could not create bloom filter", error = filterResult.error
 
-  let minCapacity =
-    (targetCapacity.float * (100 - CapacityFlexPercent).float / 100.0).int
-  let maxCapacity =
-    (targetCapacity.float * (100 + CapacityFlexPercent).float / 100.0).int
-
   info "Successfully initialized bloom filter",
-    capacity = targetCapacity, minCapacity = minCapacity, maxCapacity = maxCapacity
+    capacity = targetCapacity, maxCapacity = maxCapacity
 
   return RollingBloomFilter(
     filter: filterResult.get(),
+    current: filterResult.get(),
     capacity: targetCapacity,
-    minCapacity: minCapacity,
     maxCapacity: maxCapacity,
-    messages: @[],
+    dirty: true,
   )
 
-proc clean*(rbf: var RollingBloomFilter) {.gcsafe.} =
-  try:
-    if rbf.messages.len <= rbf.maxCapacity:
-      return # Don't clean unless we exceed max capacity
-
-    # Initialize new filter
-    var newFilter = initializeBloomFilter(rbf.maxCapacity, rbf.filter.errorRate).valueOr:
-      error "Failed to create new bloom filter", error = $error
-      return
+proc generationCapacity(rbf: RollingBloomFilter): int =
+  ## Number of IDs the active generation takes before it is rotated, so the
+  ## filter holds between ``maxCapacity div 2`` and ``maxCapacity`` IDs.
+  max(1, rbf.maxCapacity div 2)
+
+proc rotate(rbf: var RollingBloomFilter) =
+  ## Drops the aging generation: the union becomes the active generation and
+  ## a new, empty, active generation starts. Costs one pass over the bit array.
+  swap(rbf.filter.intArray, rbf.current.intArray)
+  if rbf.current.intArray.len > 0:
+    zeroMem(addr rbf.current.intArray[0], rbf.current.intArray.len * sizeof(int))
+  rbf.currentCount = 0
+  rbf.dirty = true
+
+proc isFull*(rbf: RollingBloomFilter): bool =
+  ## Whether the active generation is full and rotates on the next ``clean``
+  ## or ``add``.
+  rbf.currentCount >= rbf.generationCapacity()
 
-    # Keep most recent messages up to minCapacity
-    let keepCount = rbf.minCapacity
-    let startIdx = max(0, rbf.messages.len - keepCount)
-    var newMessages: seq[SdsMessageID] = @[]
+proc clean*(rbf: var RollingBloomFilter) {.gcsafe.} =
+  ## Rotates the generations if the active one is full. ``add`` already does
+  ## this, so calling it periodically is cheap and only a safety net.
+  if rbf.isFull():
+    rbf.rotate()
 
-    for i in startIdx ..< rbf.messages.len:
-      newMessages.add(rbf.messages[i])
-      newFilter.insert(cast[string](rbf.messages[i]))
+proc add*(rbf: var RollingBloomFilter, digest: BloomDigest) {.gcsafe.} =
+  ## Adds a message ID, given by its ``bloomDigest``, to the rolling bloom filter.
+  if rbf.currentCount >= rbf.generationCapacity():
+    rbf.rotate()
 
-    rbf.messages = newMessages
-    rbf.filter = newFilter
-  except Exception:
-    error "Failed to clean bloom filter", error = getCurrentExceptionMsg()
+  rbf.current.insert(digest)
+  rbf.filter.insert(digest)
+  rbf.currentCount += 1
 
 proc add*(rbf: var RollingBloomFilter, messageId: SdsMessageID) {.gcsafe.} =
   ## Adds a message ID to the rolling bloom filter.
   ##
   ## Parameters:
   ##   - messageId: The ID of the message to add.
-  rbf.filter.insert(cast[string](messageId))
-  rbf.messages.add(messageId)
+  rbf.add(bloomDigest(messageId))
 
-  # Clean if we exceed max capacity
-  if rbf.messages.len > rbf.maxCapacity:
-    rbf.clean()
+proc contains*(rbf: RollingBloomFilter, digest: BloomDigest): bool =
+  ## Checks if a message ID, given by its ``bloomDigest``, is in the rolling
+  ## bloom filter.
+  rbf.filter.lookup(digest)
 
 proc contains*(rbf: RollingBloomFilter, messageId: SdsMessageID): bool =
   ## Checks if a message ID is in the rolling bloom filter.
@@ -115,4 +133,4 @@ proc contains*(rbf: RollingBloomFilter, messageId: SdsMessageID): bool =
   ##
   ## Returns:
   ##   True if the message ID is probably in the filter, false otherwise.
-  rbf.filter.lookup(cast[string](messageId))
+  rbf.contains(bloomDigest(messageId))
@@ -1,6 +1,8 @@
 import std/[times, locks, tables, sequtils]
 import chronicles, results
-import ./[rolling_bloom_filter, message]
+import ./[bloom, rolling_bloom_filter, message, message_history, resend_queue]
+
+export message_history, resend_queue
 
 type
   MessageReadyCallback* =
@@ -27,24 +29,45 @@ type
   ReliabilityConfig* = object
     bloomFilterCapacity*: int
     bloomFilterErrorRate*: float
+    bloomFilterKind*: BloomFilterKind
     maxMessageHistory*: int
     maxCausalHistory*: int
     resendInterval*: Duration
     maxResendAttempts*: int
     syncMessageInterval*: Duration
     bufferSweepInterval*: Duration
+    maintenanceBudget*: int
+      ## Maximum unacknowledged messages resent or expired by one buffer sweep,
+      ## the rest is left to the next one. Not limited if not positive.
 
   ChannelContext* = ref object
+    lock*: Lock
+      ## Guards the channel state. May be taken while holding the manager
+      ## ``lock``, never the other way around.
     lamportTimestamp*: int64
-    messageHistory*: seq[SdsMessageID]
+    messageHistory*: MessageHistory
     bloomFilter*: RollingBloomFilter
     outgoingBuffer*: seq[UnacknowledgedMessage]
+    outgoingIndex*: Table[SdsMessageID, int]
+      ## Message ID -> position of the message in ``outgoingBuffer``
     incomingBuffer*: Table[SdsMessageID, IncomingMessage]
+    dependents*: Table[SdsMessageID, seq[SdsMessageID]]
+      ## Missing dependency ID -> IDs of the buffered messages waiting on it
+    bloomFilterBytes*: seq[byte]
+      ## Serialized ``bloomFilter``. Inserts are patched in while its bits are
+      ## raw; it is emptied, to be serialized again, when that cannot be done.
+    bloomFilterRawStart*: int
+      ## Position of the raw bit array in ``bloomFilterBytes``, -1 if sparse
 
   ReliabilityManager* = ref object
     channels*: Table[SdsChannelID, ChannelContext]
     config*: ReliabilityConfig
     lock*: Lock
+      ## Guards ``channels`` and the callbacks, not the channels themselves
+    resendLock*: Lock ## Guards ``resendQueue``
+    resendQueue*: ResendQueue
+      ## Next resend deadline of the unacknowledged messages of all channels
+    lastPeriodicSync*: Time ## Last ``onPeriodicSync`` call made by ``tick``
     onMessageReady*: proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.}
     onMessageSent*: proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.}
     onMissingDependencies*: proc(
@@ -53,6 +76,20 @@ type
     onPeriodicSync*: PeriodicSyncCallback
     onRetrievalHint*: RetrievalHintProvider
 
+  OutputAllocator* = proc(size: int): pointer {.nimcall, gcsafe, raises: [].}
+
+  OutputReleaser* = proc(data: pointer) {.nimcall, gcsafe, raises: [].}
+
+  AllocatedBuffer* = object
+    ## Output of ``wrapOutgoingMessage`` written to memory from ``alloc``,
+    ## for handing wrapped messages over without copying them. ``release``
+    ## frees that memory, should a wrap fail after allocating it, and in
+    ## ``free``.
+    alloc*: OutputAllocator
+    release*: OutputReleaser
+    data*: ptr UncheckedArray[byte]
+    len*: int
+
   ReliabilityError* {.pure.} = enum
     reInvalidArgument
     reOutOfMemory
@@ -69,57 +106,145 @@ proc defaultConfig*(): ReliabilityConfig =
   ReliabilityConfig(
     bloomFilterCapacity: DefaultBloomFilterCapacity,
     bloomFilterErrorRate: DefaultBloomFilterErrorRate,
+    bloomFilterKind: BloomFilterKind.Standard,
     maxMessageHistory: DefaultMaxMessageHistory,
     maxCausalHistory: DefaultMaxCausalHistory,
     resendInterval: DefaultResendInterval,
     maxResendAttempts: DefaultMaxResendAttempts,
     syncMessageInterval: DefaultSyncMessageInterval,
     bufferSweepInterval: DefaultBufferSweepInterval,
+    maintenanceBudget: DefaultMaintenanceBudget,
   )
 
+proc free*(buffer: var AllocatedBuffer) {.raises: [].} =
+  ## Releases the wrapped message held by ``buffer``, if any.
+  if not buffer.data.isNil():
+    buffer.release(buffer.data)
+  buffer.data = nil
+  buffer.len = 0
+
 proc cleanup*(rm: ReliabilityManager) {.raises: [].} =
   if not rm.isNil():
     try:
       withLock rm.lock:
         for channelId, channel in rm.channels:
-          channel.outgoingBuffer.setLen(0)
-          channel.incomingBuffer.clear()
-          channel.messageHistory.setLen(0)
+          withLock channel.lock:
+            channel.outgoingBuffer.setLen(0)
+            channel.outgoingIndex.clear()
+            channel.incomingBuffer.clear()
+            channel.dependents.clear()
+            channel.messageHistory.clear()
         rm.channels.clear()
+      withLock rm.resendLock:
+        rm.resendQueue.clear()
     except Exception:
       error "Error during cleanup", error = getCurrentExceptionMsg()
 
+proc getChannel*(
+    rm: ReliabilityManager, channelId: SdsChannelID
+): ChannelContext {.gcsafe, raises: [].} =
+  ## Looks ``channelId`` up under the manager lock. Returns nil if the channel
+  ## does not exist. The caller locks the returned channel to use it.
+  withLock rm.lock:
+    result = rm.channels.getOrDefault(channelId)
+
+proc askRetrievalHints*(
+    rm: ReliabilityManager, channel: ChannelContext, n: int
+) {.gcsafe.} =
+  ## Asks the retrieval hint provider for the hints not known yet of the ``n``
+  ## most recent IDs of ``channel``, and caches them. The provider is called
+  ## without any lock held, so it may call back into the manager; the channel
+  ## lock must not be held either.
+  var provider: RetrievalHintProvider
+  withLock rm.lock:
+    provider = rm.onRetrievalHint
+  if provider.isNil():
+    return
+
+  var msgIds: seq[SdsMessageID]
+  withLock channel.lock:
+    msgIds = channel.messageHistory.unknownHints(n)
+  if msgIds.len == 0:
+    return
+
+  var hints = newSeq[seq[byte]](msgIds.len)
+  for i, msgId in msgIds:
+    hints[i] = provider(msgId)
+  withLock channel.lock:
+    for i, msgId in msgIds:
+      discard channel.messageHistory.setRetrievalHint(msgId, hints[i])
+
 proc cleanBloomFilter*(
     rm: ReliabilityManager, channelId: SdsChannelID
 ) {.gcsafe, raises: [].} =
-  withLock rm.lock:
+  let channel = rm.getChannel(channelId)
+  if channel.isNil():
+    return
+  withLock channel.lock:
     try:
-      if channelId in rm.channels:
-        rm.channels[channelId].bloomFilter.clean()
+      channel.bloomFilter.clean()
+      if channel.bloomFilter.dirty:
+        channel.bloomFilterBytes.setLen(0)
+        channel.bloomFilter.dirty = false
     except Exception:
       error "Failed to clean bloom filter",
         error = getCurrentExceptionMsg(), channelId = channelId
 
+proc addToBloomFilter*[T: SdsMessageID | BloomDigest](
+    channel: ChannelContext, id: T
+) {.raises: [].} =
+  ## Adds ``id`` to the bloom filter of ``channel``, which rotates once full.
+  ## The channel lock must be held.
+  let digest =
+    when T is BloomDigest: id
+    else: bloomDigest(id)
+  channel.bloomFilter.add(digest)
+  if channel.bloomFilter.dirty or channel.bloomFilterRawStart < 0:
+    # Rotated, or sparse bits that cannot be patched in place
+    channel.bloomFilterBytes.setLen(0)
+    channel.bloomFilter.dirty = false
+  elif channel.bloomFilterBytes.len > 0:
+    channel.bloomFilter.filter.patchRawBits(
+      digest,
+      channel.bloomFilterBytes.toOpenArray(
+        channel.bloomFilterRawStart, channel.bloomFilterBytes.high
+      ),
+    )
+
+proc addToHistory*(channel: ChannelContext, msgId: SdsMessageID) {.raises: [].} =
+  channel.messageHistory.add(msgId)
+
 proc addToHistory*(
     rm: ReliabilityManager, msgId: SdsMessageID, channelId: SdsChannelID
 ) {.gcsafe, raises: [].} =
+  let channel = rm.getChannel(channelId)
+  if channel.isNil():
+    return
   try:
-    if channelId in rm.channels:
-      let channel = rm.channels[channelId]
-      channel.messageHistory.add(msgId)
-      if channel.messageHistory.len > rm.config.maxMessageHistory:
-        channel.messageHistory.delete(0)
+    withLock channel.lock:
+      channel.addToHistory(msgId)
   except Exception:
     error "Failed to add to history",
       channelId = channelId, msgId = msgId, error = getCurrentExceptionMsg()
 
+proc reindexOutgoing*(channel: ChannelContext) {.raises: [].} =
+  ## Rebuilds ``outgoingIndex`` after messages were removed from ``outgoingBuffer``.
+  channel.outgoingIndex.clear()
+  for i, unackMsg in channel.outgoingBuffer:
+    channel.outgoingIndex[unackMsg.message.messageId] = i
+
+proc updateLamportTimestamp*(channel: ChannelContext, msgTs: int64) {.raises: [].} =
+  channel.lamportTimestamp = max(msgTs, channel.lamportTimestamp) + 1
+
 proc updateLamportTimestamp*(
     rm: ReliabilityManager, msgTs: int64, channelId: SdsChannelID
 ) {.gcsafe, raises: [].} =
+  let channel = rm.getChannel(channelId)
+  if channel.isNil():
+    return
   try:
-    if channelId in rm.channels:
-      let channel = rm.channels[channelId]
-      channel.lamportTimestamp = max(msgTs, channel.lamportTimestamp) + 1
+    withLock channel.lock:
+      channel.updateLamportTimestamp(msgTs)
   except Exception:
     error "Failed to update lamport timestamp",
       channelId = channelId, msgTs = msgTs, error = getCurrentExceptionMsg()
@@ -141,40 +266,44 @@ proc getRecentHistoryEntries*(
     rm: ReliabilityManager, n: int, channelId: SdsChannelID
 ): seq[HistoryEntry] =
   ## Get recent history entries for sending in causal history.
-  ## Populates retrieval hints for our own messages using the provider callback.
+  ## Populates retrieval hints from the history, asking the provider callback
+  ## only for the IDs whose hint is not known yet.
+  let channel = rm.getChannel(channelId)
+  if channel.isNil():
+    return @[]
   try:
-    if channelId in rm.channels:
-      let channel = rm.channels[channelId]
-      let recentMessageIds = channel.messageHistory[max(0, channel.messageHistory.len - n) .. ^1]
-      if rm.onRetrievalHint.isNil():
-        return toCausalHistory(recentMessageIds)
-      else:
-        var entries: seq[HistoryEntry] = @[]
-        for msgId in recentMessageIds:
-          let hint = rm.onRetrievalHint(msgId)
-          entries.add(newHistoryEntry(msgId, hint))
-        return entries
-    else:
-      return @[]
+    rm.askRetrievalHints(channel, n)
+    withLock channel.lock:
+      var entries =
+        newSeqOfCap[HistoryEntry](max(0, min(n, channel.messageHistory.len)))
+      for record in channel.messageHistory.recentRecords(n):
+        entries.add(newHistoryEntry(record.messageId, record.retrievalHint))
+      return entries
   except Exception:
     error "Failed to get recent history entries",
       channelId = channelId, n = n, error = getCurrentExceptionMsg()
     return @[]
 
+proc checkDependencies*(
+    channel: ChannelContext, deps: seq[HistoryEntry]
+): seq[HistoryEntry] {.raises: [].} =
+  ## Check which dependencies are missing from the message history of ``channel``.
+  for dep in deps:
+    if dep.messageId notin channel.messageHistory:
+      result.add(dep)
+
 proc checkDependencies*(
     rm: ReliabilityManager, deps: seq[HistoryEntry], channelId: SdsChannelID
 ): seq[HistoryEntry] =
   ## Check which dependencies are missing from our message history.
+  let channel = rm.getChannel(channelId)
+  if channel.isNil():
+    return deps # Channel doesn't exist, all deps are missing
+
   var missingDeps: seq[HistoryEntry] = @[]
   try:
-    if channelId in rm.channels:
-      let channel = rm.channels[channelId]
-      for dep in deps:
-        if dep.messageId notin channel.messageHistory:
-          missingDeps.add(dep)
-    else:
-      # Channel doesn't exist, all deps are missing
-      missingDeps = deps
+    withLock channel.lock:
+      missingDeps = channel.checkDependencies(deps)
   except Exception:
     error "Failed to check dependencies",
       channelId = channelId, error = getCurrentExceptionMsg()
@@ -184,12 +313,13 @@ proc checkDependencies*(
 proc getMessageHistory*(
     rm: ReliabilityManager, channelId: SdsChannelID
 ): seq[SdsMessageID] =
-  withLock rm.lock:
+  let channel = rm.getChannel(channelId)
+  if channel.isNil():
+    return @[]
+  withLock channel.lock:
     try:
-      if channelId in rm.channels:
-        result = rm.channels[channelId].messageHistory
-      else:
-        result = @[]
+      for msgId in channel.messageHistory:
+        result.add(msgId)
     except Exception:
       error "Failed to get message history",
         channelId = channelId, error = getCurrentExceptionMsg()
@@ -198,12 +328,12 @@ proc getMessageHistory*(
 proc getOutgoingBuffer*(
     rm: ReliabilityManager, channelId: SdsChannelID
 ): seq[UnacknowledgedMessage] =
-  withLock rm.lock:
+  let channel = rm.getChannel(channelId)
+  if channel.isNil():
+    return @[]
+  withLock channel.lock:
     try:
-      if channelId in rm.channels:
-        result = rm.channels[channelId].outgoingBuffer
-      else:
-        result = @[]
+      result = channel.outgoingBuffer
     except Exception:
       error "Failed to get outgoing buffer",
         channelId = channelId, error = getCurrentExceptionMsg()
@@ -212,12 +342,12 @@ proc getOutgoingBuffer*(
 proc getIncomingBuffer*(
     rm: ReliabilityManager, channelId: SdsChannelID
 ): Table[SdsMessageID, message.IncomingMessage] =
-  withLock rm.lock:
+  let channel = rm.getChannel(channelId)
+  if channel.isNil():
+    return initTable[SdsMessageID, message.IncomingMessage]()
+  withLock channel.lock:
     try:
-      if channelId in rm.channels:
-        result = rm.channels[channelId].incomingBuffer
-      else:
-        result = initTable[SdsMessageID, message.IncomingMessage]()
+      result = channel.incomingBuffer
     except Exception:
       error "Failed to get incoming buffer",
         channelId = channelId, error = getCurrentExceptionMsg()
@@ -228,21 +358,34 @@ proc getOrCreateChannel*(
 ): ChannelContext =
   try:
     if channelId notin rm.channels:
-      rm.channels[channelId] = ChannelContext(
+      let channel = ChannelContext(
         lamportTimestamp: 0,
-        messageHistory: @[],
+        messageHistory: initMessageHistory(
+          rm.config.maxMessageHistory, rm.config.maxCausalHistory
+        ),
         bloomFilter: newRollingBloomFilter(
-          rm.config.bloomFilterCapacity, rm.config.bloomFilterErrorRate
+          rm.config.bloomFilterCapacity, rm.config.bloomFilterErrorRate,
+          rm.config.bloomFilterKind,
         ),
         outgoingBuffer: @[],
+        outgoingIndex: initTable[SdsMessageID, int](),
         incomingBuffer: initTable[SdsMessageID, IncomingMessage](),
+        dependents: initTable[SdsMessageID, seq[SdsMessageID]](),
       )
+      initLock(channel.lock)
+      rm.channels[channelId] = channel
     result = rm.channels[channelId]
   except Exception:
     error "Failed to get or create channel",
       channelId = channelId, error = getCurrentExceptionMsg()
     raise
 
+proc openChannel*(rm: ReliabilityManager, channelId: SdsChannelID): ChannelContext =
+  ## Like ``getOrCreateChannel`` but takes the manager lock for the lookup.
+  ## The caller locks the returned channel to use it.
+  withLock rm.lock:
+    result = rm.getOrCreateChannel(channelId)
+
 proc ensureChannel*(
     rm: ReliabilityManager, channelId: SdsChannelID
 ): Result[void, ReliabilityError] =
@@ -260,12 +403,14 @@ proc removeChannel*(
 ): Result[void, ReliabilityError] =
   withLock rm.lock:
     try:
-      if channelId in rm.channels:
-        let channel = rm.channels[channelId]
-        channel.outgoingBuffer.setLen(0)
-        channel.incomingBuffer.clear()
-        channel.messageHistory.setLen(0)
-        rm.channels.del(channelId)
+      var channel: ChannelContext
+      if rm.channels.pop(channelId, channel):
+        withLock channel.lock:
+          channel.outgoingBuffer.setLen(0)
+          channel.outgoingIndex.clear()
+          channel.incomingBuffer.clear()
+          channel.dependents.clear()
+          channel.messageHistory.clear()
       return ok()
     except Exception:
       error "Failed to remove channel",
@@ -0,0 +1,206 @@
+## Channel-partitioned ReliabilityManager for multi-channel deployments.
+##
+## Channels are spread over N independent ``ReliabilityManager`` shards by the
+## hash of their ``SdsChannelID``. Batches of messages are split per shard and
+## each shard's part runs as a single task on a ``Taskpool``, so shards work in
+## parallel while the messages of a channel are still processed in order, by
+## one thread at a time.
+##
+## Shard state is handed between threads, which requires ``--mm:orc`` or
+## ``--mm:arc``. Its refs, such as the channels and the callback environments,
+## do not have atomic reference counts, so only one thread may use a shard at
+## a time: every call, single message or batch, must be made from the thread
+## that created the manager. Batches return once all their tasks are done.
+## Single message calls run on that thread too.
+##
+## The callbacks are invoked from the worker threads during batches and from
+## the creating thread otherwise. They must not call into the sharded manager.
+
+import std/hashes
+import chronicles, results, taskpools
+import ../sds
+
+export sds
+
+when not compileOption("threads"):
+  {.error: "sharded_manager requires --threads:on".}
+when not (defined(gcOrc) or defined(gcArc) or defined(gcAtomicArc)):
+  {.error: "sharded_manager requires --mm:orc or --mm:arc".}
+
+type
+  ShardedReliabilityManager* = ref object
+    shards*: seq[ReliabilityManager]
+    pool: Taskpool
+
+  WrapRequest* =
+    tuple[message: seq[byte], messageId: SdsMessageID, channelId: SdsChannelID]
+
+  WrapResult* = Result[seq[byte], ReliabilityError]
+
+  UnwrapResult* = Result[
+    tuple[message: seq[byte], missingDeps: seq[HistoryEntry], channelId: SdsChannelID],
+    ReliabilityError,
+  ]
+
+  ShardJob[I, O] = object
+    ## Part of a batch owned by one shard. ``indices`` are the positions of
+    ## its messages in ``inputs`` and ``outputs``, in batch order.
+    shard: ReliabilityManager
+    inputs: ptr UncheckedArray[I]
+    outputs: ptr UncheckedArray[O]
+    indices: seq[int]
+
+proc newShardedReliabilityManager*(
+    numShards: int, config: ReliabilityConfig = defaultConfig()
+): Result[ShardedReliabilityManager, ReliabilityError] =
+  ## Creates a manager with ``numShards`` shards and as many worker threads.
+  if numShards < 1:
+    return err(ReliabilityError.reInvalidArgument)
+
+  var shards = newSeqOfCap[ReliabilityManager](numShards)
+  for _ in 0 ..< numShards:
+    shards.add(?newReliabilityManager(config))
+
+  try:
+    ok(ShardedReliabilityManager(shards: shards, pool: Taskpool.new(numShards)))
+  except Exception:
+    error "Failed to create task pool", msg = getCurrentExceptionMsg()
+    err(ReliabilityError.reInternalError)
+
+proc shardIndex(srm: ShardedReliabilityManager, channelId: SdsChannelID): int =
+  int(cast[uint](hash(channelId)) mod uint(srm.shards.len))
+
+proc shardFor*(
+    srm: ShardedReliabilityManager, channelId: SdsChannelID
+): ReliabilityManager =
+  ## Returns the shard owning ``channelId``.
+  srm.shards[srm.shardIndex(channelId)]
+
+proc setCallbacks*(
+    srm: ShardedReliabilityManager,
+    onMessageReady: MessageReadyCallback,
+    onMessageSent: MessageSentCallback,
+    onMissingDependencies: MissingDependenciesCallback,
+    onPeriodicSync: PeriodicSyncCallback = nil,
+    onRetrievalHint: RetrievalHintProvider = nil,
+) =
+  ## Sets the callbacks of every shard. They must be safe to call from the
+  ## worker threads, and must not call into ``srm``.
+  for shard in srm.shards:
+    shard.setCallbacks(
+      onMessageReady, onMessageSent, onMissingDependencies, onPeriodicSync,
+      onRetrievalHint,
+    )
+
+proc ensureChannel*(
+    srm: ShardedReliabilityManager, channelId: SdsChannelID
+): Result[void, ReliabilityError] =
+  srm.shardFor(channelId).ensureChannel(channelId)
+
+proc removeChannel*(
+    srm: ShardedReliabilityManager, channelId: SdsChannelID
+): Result[void, ReliabilityError] =
+  srm.shardFor(channelId).removeChannel(channelId)
+
+proc markDependenciesMet*(
+    srm: ShardedReliabilityManager,
+    messageIds: seq[SdsMessageID],
+    channelId: SdsChannelID,
+): Result[void, ReliabilityError] =
+  srm.shardFor(channelId).markDependenciesMet(messageIds, channelId)
+
+proc wrapOutgoingMessage*(
+    srm: ShardedReliabilityManager,
+    message: seq[byte],
+    messageId: SdsMessageID,
+    channelId: SdsChannelID,
+): WrapResult =
+  ## Wraps a single message in the owning shard, on the creating thread.
+  srm.shardFor(channelId).wrapOutgoingMessage(message, messageId, channelId)
+
+proc unwrapReceivedMessage*(
+    srm: ShardedReliabilityManager, message: openArray[byte]
+): UnwrapResult =
+  ## Unwraps a single message in the owning shard, on the creating thread. The
+  ## message is decoded once, for both routing and unwrapping.
+  let msg = ?decodeReceivedMessage(message)
+  srm.shardFor(msg.channelId).unwrapReceivedMessage(msg)
+
+proc runWrapJob(job: ptr ShardJob[WrapRequest, WrapResult]) {.gcsafe.} =
+  for i in job.indices:
+    let request = addr job.inputs[i]
+    job.outputs[i] = job.shard.wrapOutgoingMessage(
+      request.message, request.messageId, request.channelId
+    )
+
+proc runUnwrapJob(job: ptr ShardJob[SdsMessageView, UnwrapResult]) {.gcsafe.} =
+  for i in job.indices:
+    job.outputs[i] = job.shard.unwrapReceivedMessage(job.inputs[i])
+
+proc initJobs[I, O](
+    srm: ShardedReliabilityManager, inputs: openArray[I], outputs: var seq[O]
+): seq[ShardJob[I, O]] =
+  result = newSeq[ShardJob[I, O]](srm.shards.len)
+  for s, job in result.mpairs:
+    job.shard = srm.shards[s]
+    job.inputs = cast[ptr UncheckedArray[I]](unsafeAddr inputs[0])
+    job.outputs = cast[ptr UncheckedArray[O]](addr outputs[0])
+
+proc wrapOutgoingMessages*(
+    srm: ShardedReliabilityManager, requests: openArray[WrapRequest]
+): seq[WrapResult] =
+  ## Wraps a batch of messages, in parallel across shards. Results are in the
+  ## order of ``requests``.
+  result = newSeq[WrapResult](requests.len)
+  if requests.len == 0:
+    return
+
+  var jobs = srm.initJobs(requests, result)
+  for i, request in requests:
+    jobs[srm.shardIndex(request.channelId)].indices.add(i)
+
+  for job in jobs.mitems:
+    if job.indices.len > 0:
+      srm.pool.spawn runWrapJob(addr job)
+  srm.pool.syncAll()
+
+proc unwrapReceivedMessages*(
+    srm: ShardedReliabilityManager, messages: openArray[seq[byte]]
+): seq[UnwrapResult] =
+  ## Unwraps a batch of received messages, in parallel across shards. Results
+  ## are in the order of ``messages``.
+  result = newSeq[UnwrapResult](messages.len)
+  if messages.len == 0:
+    return
+
+  # Messages are decoded once here; workers read them through the views
+  var views = newSeq[SdsMessageView](messages.len)
+  var jobs = srm.initJobs(views, result)
+  for i, message in messages:
+    views[i] = decodeReceivedMessage(message).valueOr:
+      result[i] = err(ReliabilityError.reDeserializationError)
+      continue
+    jobs[srm.shardIndex(views[i].channelId)].indices.add(i)
+
+  for job in jobs.mitems:
+    if job.indices.len > 0:
+      srm.pool.spawn runUnwrapJob(addr job)
+  srm.pool.syncAll()
+
+proc startPeriodicTasks*(srm: ShardedReliabilityManager) =
+  ## Starts the periodic tasks of every shard on the calling thread's event loop.
+  for shard in srm.shards:
+    shard.startPeriodicTasks()
+
+proc cleanup*(srm: ShardedReliabilityManager) {.raises: [].} =
+  ## Stops the worker threads and clears every shard.
+  if srm.isNil():
+    return
+  if not srm.pool.isNil():
+    try:
+      srm.pool.shutdown()
+    except Exception:
+      error "Failed to shut down task pool", msg = getCurrentExceptionMsg()
+    srm.pool = nil
+  for shard in srm.shards:
+    shard.cleanup()
@@ -1,5 +1,6 @@
 import unittest, results, strutils
 import sds/bloom
+import sds/private/murmur3
 from random import rand, randomize
 
 suite "bloom filter":
@@ -99,6 +100,15 @@ suite "bloom filter":
     check str.contains("4 hash") # Hash functions
     check str.contains("1.0e-02") # Error rate in scientific notation
 
+  test "stable hashing":
+    # Reference vectors for MurmurHash3_x64_128 with seed 0
+    check murmurHash3x64_128(newSeq[byte]()) == (0'u64, 0'u64)
+    check murmurHash3x64_128("hello".toOpenArrayByte(0, 4)) ==
+      (0xcbd8a7b341bd9b02'u64, 0x5b1e906a48ae1d19'u64)
+    let fox = "The quick brown fox jumps over the lazy dog"
+    check murmurHash3x64_128(fox.toOpenArrayByte(0, fox.high)) ==
+      (0xe34bbc7bbc071b6c'u64, 0x7a433ca9c49a9347'u64)
+
 suite "bloom filter special cases":
   test "different patterns of strings":
     const testSize = 10_000
@@ -143,3 +153,36 @@ suite "bloom filter special cases":
 
     let fpRate = falsePositives.float / fpTestSize.float
     check fpRate < bf.errorRate * 1.5 # Allow some margin but should be close to target
+
+suite "blocked bloom filter":
+  test "layout, recall and error rate":
+    const testSize = 10_000
+    let bfResult =
+      initializeBloomFilter(testSize, 0.001, kind = BloomFilterKind.Blocked)
+    check bfResult.isOk
+    var bf = bfResult.get
+    check:
+      bf.kind == BloomFilterKind.Blocked
+      bf.mBits mod BlockBits == 0
+      bf.mBits >= testSize * 15
+
+    var inserted = newSeq[string](testSize)
+    for i in 0 ..< testSize:
+      inserted[i] = "blocked" & $i & "-" & $rand(1000)
+      bf.insert(inserted[i])
+
+    var lookupErrors = 0
+    for item in inserted:
+      if not bf.lookup(item):
+        lookupErrors.inc()
+    check lookupErrors == 0
+
+    # Enough absent items to measure a rate of 0.1% within a few percent
+    var falsePositives = 0
+    let fpTestSize = 200_000
+    for i in 0 ..< fpTestSize:
+      if bf.lookup("absent" & $i & "-" & $rand(1000)):
+        falsePositives.inc()
+
+    let fpRate = falsePositives.float / fpTestSize.float
+    check fpRate < bf.errorRate * 1.2 # 20% tolerance for the sampling noise
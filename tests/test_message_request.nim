@@ -0,0 +1,118 @@
+import unittest, chronos, results
+import sds
+import library/[alloc, ffi_types]
+import library/sds_thread/inter_thread_communication/requests/sds_message_request
+
+const testChannel = "testChannel"
+
+type DecodedUnwrap = object
+  content: seq[byte]
+  channelId: string
+  missingDeps: seq[HistoryEntry]
+
+proc readUint32(buf: openArray[byte], pos: var int): int =
+  check pos + 4 <= buf.len
+  for i in 0 ..< 4:
+    result = result or (int(buf[pos + i]) shl (8 * i))
+  pos += 4
+
+proc readSection(buf: openArray[byte], pos: var int): seq[byte] =
+  let len = buf.readUint32(pos)
+  check pos + len <= buf.len
+  result = @(buf.toOpenArray(pos, pos + len - 1))
+  pos += len
+
+proc decodeUnwrap(buf: openArray[byte]): DecodedUnwrap =
+  ## Reads the binary unwrap response field by field, as documented for
+  ## SdsUnwrapReceivedMessageBytes in libsds.h.
+  var pos = 0
+  result.content = buf.readSection(pos)
+  result.channelId = cast[string](buf.readSection(pos))
+  let count = buf.readUint32(pos)
+  for _ in 0 ..< count:
+    let messageId = cast[string](buf.readSection(pos))
+    result.missingDeps.add(newHistoryEntry(messageId, buf.readSection(pos)))
+  check pos == buf.len # nothing follows the last section
+
+proc unwrapRequest(serialized: seq[byte], flags: cuint = 0): ptr SdsMessageRequest =
+  SdsMessageRequest.createShared(
+    SdsMessageMsgType.UNWRAP_MESSAGE_BYTES,
+    unsafeAddr serialized[0],
+    csize_t(serialized.len),
+    flags = flags,
+  )
+
+suite "Binary unwrap responses":
+  var rm: ReliabilityManager
+
+  setup:
+    rm = newReliabilityManager().get()
+
+  teardown:
+    rm.cleanup()
+
+  test "a message without missing dependencies":
+    let serialized = serializeMessage(
+      SdsMessage(
+        messageId: "no-deps",
+        lamportTimestamp: 1,
+        channelId: testChannel,
+        content: @[byte(1), 2, 3],
+      )
+    ).get()
+
+    let response = waitFor unwrapRequest(serialized).process(addr rm)
+    check response.isOk()
+    let decoded = decodeUnwrap(response.get().toOpenArrayByte(0, response.get().high))
+    check:
+      decoded.content == @[byte(1), 2, 3]
+      decoded.channelId == testChannel
+      decoded.missingDeps.len == 0
+
+  test "missing dependencies with and without retrieval hints":
+    let deps = @[
+      newHistoryEntry("dep1"),
+      newHistoryEntry("dep2", @[byte(7), 8, 9]),
+      newHistoryEntry("dep3"),
+    ]
+    let serialized = serializeMessage(
+      SdsMessage(
+        messageId: "with-deps",
+        lamportTimestamp: 1,
+        causalHistory: deps,
+        channelId: testChannel,
+        content: @[byte(4)],
+      )
+    ).get()
+
+    let response = waitFor unwrapRequest(serialized).process(addr rm)
+    check response.isOk()
+    let decoded = decodeUnwrap(response.get().toOpenArrayByte(0, response.get().high))
+    check:
+      decoded.content == @[byte(4)]
+      decoded.channelId == testChannel
+      decoded.missingDeps == deps
+
+  test "transferred responses have the same layout":
+    let deps = @[newHistoryEntry("dep1", @[byte(5)]), newHistoryEntry("dep2")]
+    let serialized = serializeMessage(
+      SdsMessage(
+        messageId: "transferred",
+        lamportTimestamp: 1,
+        causalHistory: deps,
+        channelId: testChannel,
+        content: newSeq[byte](300),
+      )
+    ).get()
+
+    let request = unwrapRequest(serialized, SDS_BORROW_INPUT or SDS_TRANSFER_RESULT)
+    check request.transfersResult()
+    let response = waitFor request.processTransfer(addr rm)
+    check response.isOk()
+    let buffer = response.get()
+    let decoded = decodeUnwrap(buffer.data.toOpenArray(0, buffer.len - 1))
+    freeSharedBuffer(buffer.data)
+    check:
+      decoded.content == newSeq[byte](300)
+      decoded.channelId == testChannel
+      decoded.missingDeps == deps
@@ -1,5 +1,5 @@
 import unittest, results, chronos, std/[times, options, tables]
-import sds
+import sds, sds/sharded_manager
 
 const testChannel = "testChannel"
 
@@ -166,6 +166,43 @@ suite "Reliability Mechanisms":
       messageReadyCount == 2 # Both msg2 and msg3 should be ready
       missingDepsCount == 2 # Should still be 2 from the initial missing deps
 
+  test "delivered message releases buffered dependents":
+    var readyOrder: seq[SdsMessageID] = @[]
+
+    rm.setCallbacks(
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        readyOrder.add(messageId),
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc(messageId: SdsMessageID, missingDeps: seq[HistoryEntry], channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+    )
+
+    # msg3 -> msg2 -> msg1, received in reverse order
+    var serialized: seq[seq[byte]] = @[]
+    for i in 1 .. 3:
+      let msg = SdsMessage(
+        messageId: "msg" & $i,
+        lamportTimestamp: int64(i),
+        causalHistory:
+          if i == 1: newSeq[HistoryEntry]() else: toCausalHistory(@["msg" & $(i - 1)]),
+        channelId: testChannel,
+        content: @[byte(i)],
+        bloomFilter: @[],
+      )
+      serialized.add(serializeMessage(msg).get())
+
+    check:
+      rm.unwrapReceivedMessage(serialized[2]).isOk()
+      rm.unwrapReceivedMessage(serialized[1]).isOk()
+      readyOrder.len == 0
+      rm.getIncomingBuffer(testChannel).len == 2
+
+    check rm.unwrapReceivedMessage(serialized[0]).isOk()
+    check:
+      readyOrder == @["msg1", "msg2", "msg3"]
+      rm.getIncomingBuffer(testChannel).len == 0
+
   test "acknowledgment via causal history":
     var messageReadyCount = 0
     var messageSentCount = 0
@@ -251,6 +288,83 @@ suite "Reliability Mechanisms":
 
     check messageSentCount == 1 # Our message should be acknowledged via bloom filter
 
+  test "acknowledgments keep the outgoing index in sync":
+    var sentIds: seq[SdsMessageID] = @[]
+
+    rm.setCallbacks(
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        sentIds.add(messageId),
+      proc(messageId: SdsMessageID, missingDeps: seq[HistoryEntry], channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+    )
+
+    for i in 1 .. 5:
+      check rm.wrapOutgoingMessage(@[byte(i)], "out" & $i, testChannel).isOk()
+
+    # Ack out2 and out4 through causal history
+    let ack1 = SdsMessage(
+      messageId: "peer1",
+      lamportTimestamp: rm.channels[testChannel].lamportTimestamp + 1,
+      causalHistory: toCausalHistory(@["out2", "out4"]),
+      channelId: testChannel,
+      content: @[byte(1)],
+      bloomFilter: @[],
+    )
+    check rm.unwrapReceivedMessage(serializeMessage(ack1).get()).isOk()
+
+    check:
+      sentIds == @["out2", "out4"]
+      rm.getOutgoingBuffer(testChannel).len == 3
+      rm.channels[testChannel].outgoingIndex.len == 3
+      rm.channels[testChannel].outgoingIndex["out5"] == 2
+
+    # Ack out5 through causal history and out1 through the bloom filter
+    var otherPartyBloomFilter =
+      newRollingBloomFilter(DefaultBloomFilterCapacity, DefaultBloomFilterErrorRate)
+    otherPartyBloomFilter.add("out1")
+    let ack2 = SdsMessage(
+      messageId: "peer2",
+      lamportTimestamp: rm.channels[testChannel].lamportTimestamp + 1,
+      causalHistory: toCausalHistory(@["out5"]),
+      channelId: testChannel,
+      content: @[byte(2)],
+      bloomFilter: serializeBloomFilter(otherPartyBloomFilter.filter).get(),
+    )
+    check rm.unwrapReceivedMessage(serializeMessage(ack2).get()).isOk()
+
+    let remaining = rm.getOutgoingBuffer(testChannel)
+    check:
+      sentIds == @["out2", "out4", "out1", "out5"]
+      remaining.len == 1
+      remaining[0].message.messageId == "out3"
+      rm.channels[testChannel].outgoingIndex["out3"] == 0
+
+  test "buffers retain messages without their bloom filter":
+    check rm.wrapOutgoingMessage(@[byte(1)], "kept1", testChannel).isOk()
+    check rm.wrapOutgoingMessage(@[byte(2)], "kept2", testChannel).isOk()
+
+    let retained = rm.getOutgoingBuffer(testChannel)[1].message
+    check:
+      retained.messageId == "kept2"
+      retained.causalHistory == @["kept1"]
+      retained.content == @[byte(2)]
+
+    let waiting = SdsMessage(
+      messageId: "waiting",
+      lamportTimestamp: 1,
+      causalHistory: toCausalHistory(@["unknown"]),
+      channelId: testChannel,
+      content: @[byte(3)],
+      bloomFilter: @[byte(1), 2, 3],
+    )
+    check rm.unwrapReceivedMessage(serializeMessage(waiting).get()).isOk()
+    let buffered = rm.getIncomingBuffer(testChannel)["waiting"].message
+    check:
+      buffered.causalHistory == @["unknown"]
+      buffered.content == @[byte(3)]
+
   test "retrieval hints":
     var messageReadyCount = 0
     var messageSentCount = 0
@@ -322,6 +436,78 @@ suite "Reliability Mechanisms":
     # The hint should be preserved from the remote sender
     check missingDeps4[0].retrievalHint == cast[seq[byte]]("remote-hint")
 
+  test "retrieval hints are cached in the history":
+    var providerCalls: seq[SdsMessageID] = @[]
+
+    rm.setCallbacks(
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc(messageId: SdsMessageID, missingDeps: seq[HistoryEntry], channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      nil,
+      proc(messageId: SdsMessageID): seq[byte] =
+        providerCalls.add(messageId)
+        return cast[seq[byte]]("hint:" & messageId)
+    )
+
+    # A received message is in the history without a hint, until a peer
+    # references it with one
+    let peerMsg = SdsMessage(
+      messageId: "peer", lamportTimestamp: 1, channelId: testChannel, content: @[byte(1)]
+    )
+    check rm.unwrapReceivedMessage(serializeMessage(peerMsg).get()).isOk()
+    let ackMsg = SdsMessage(
+      messageId: "ack",
+      lamportTimestamp: 2,
+      causalHistory: @[newHistoryEntry("peer", cast[seq[byte]]("peer-hint"))],
+      channelId: testChannel,
+      content: @[byte(2)],
+    )
+    check rm.unwrapReceivedMessage(serializeMessage(ackMsg).get()).isOk()
+
+    for i in 1 .. 3:
+      check rm.wrapOutgoingMessage(@[byte(i)], "own" & $i, testChannel).isOk()
+    let wrapped = deserializeMessage(
+      rm.wrapOutgoingMessage(@[byte(4)], "own4", testChannel).get()
+    ).get()
+
+    check:
+      # Each ID is looked up at most once, and never when a peer gave its hint
+      providerCalls == @["ack", "own1", "own2", "own3"]
+      wrapped.causalHistory[0] == newHistoryEntry("peer", cast[seq[byte]]("peer-hint"))
+      wrapped.causalHistory[^1] == newHistoryEntry("own3", cast[seq[byte]]("hint:own3"))
+
+  test "retrieval hints not available yet are asked for again":
+    var providerCalls = 0
+    rm.setCallbacks(
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc(messageId: SdsMessageID, missingDeps: seq[HistoryEntry], channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      nil,
+      proc(messageId: SdsMessageID): seq[byte] =
+        providerCalls += 1
+        # The first lookup happens before the hint is known, as with no provider
+        if providerCalls == 1: newSeq[byte]() else: cast[seq[byte]]("late-hint"),
+    )
+
+    check rm.wrapOutgoingMessage(@[byte(1)], "early", testChannel).isOk()
+    let first = deserializeMessage(
+      rm.wrapOutgoingMessage(@[byte(2)], "second", testChannel).get()
+    ).get()
+    let next = deserializeMessage(
+      rm.wrapOutgoingMessage(@[byte(3)], "third", testChannel).get()
+    ).get()
+
+    check:
+      first.causalHistory == @[newHistoryEntry("early")]
+      next.causalHistory[0] == newHistoryEntry("early", cast[seq[byte]]("late-hint"))
+      providerCalls == 3 # "early" twice, "second" once
+
 # Periodic task & Buffer management tests
 suite "Periodic Tasks & Buffer Management":
   var rm: ReliabilityManager
@@ -460,6 +646,97 @@ suite "Periodic Tasks & Buffer Management":
 
     check syncCallCount > 0
 
+  test "tick runs the periodic work that is due":
+    var messageSentCount = 0
+    var syncCallCount = 0
+
+    var config = defaultConfig()
+    config.resendInterval = initDuration(milliseconds = 50)
+    config.maxResendAttempts = 1
+
+    let rm = newReliabilityManager(config).get()
+    rm.setCallbacks(
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        messageSentCount += 1,
+      proc(messageId: SdsMessageID, missingDeps: seq[HistoryEntry], channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc() {.gcsafe.} =
+        syncCallCount += 1,
+    )
+
+    check rm.wrapOutgoingMessage(@[byte(1)], "ticked", testChannel).isOk()
+    let delay = rm.tick()
+    check:
+      syncCallCount == 1
+      delay <= config.resendInterval + initDuration(milliseconds = 1)
+      rm.getOutgoingBuffer(testChannel)[0].resendAttempts == 0
+
+    waitFor sleepAsync(chronos.milliseconds(60))
+    discard rm.tick()
+    check rm.getOutgoingBuffer(testChannel)[0].resendAttempts == 1
+
+    waitFor sleepAsync(chronos.milliseconds(60))
+    discard rm.tick()
+    check:
+      rm.getOutgoingBuffer(testChannel).len == 0
+      messageSentCount == 1
+      syncCallCount == 1 # not due again before syncMessageInterval
+
+    rm.cleanup()
+
+  test "resend deadlines survive a change of resendInterval":
+    var config = defaultConfig()
+    config.resendInterval = initDuration(milliseconds = 50)
+    let rm = newReliabilityManager(config).get()
+
+    check rm.wrapOutgoingMessage(@[byte(1)], "rescheduled", testChannel).isOk()
+    rm.config.resendInterval = initDuration(seconds = 10)
+    waitFor sleepAsync(chronos.milliseconds(60))
+    discard rm.tick()
+    check rm.getOutgoingBuffer(testChannel)[0].resendAttempts == 1
+
+    rm.cleanup()
+
+  test "acknowledged messages do not use up the sweep budget":
+    var config = defaultConfig()
+    config.resendInterval = initDuration(milliseconds = 50)
+    config.maintenanceBudget = 1
+
+    let rm = newReliabilityManager(config).get()
+    for id in ["acked0", "acked1", "acked2", "live0", "live1"]:
+      check rm.wrapOutgoingMessage(@[byte(1)], id, testChannel).isOk()
+
+    # Their resend deadlines are left stale in the queue
+    let ackMsg = SdsMessage(
+      messageId: "ack",
+      lamportTimestamp: rm.channels[testChannel].lamportTimestamp + 1,
+      causalHistory: toCausalHistory(@["acked0", "acked1", "acked2"]),
+      channelId: testChannel,
+      content: @[byte(100)],
+      bloomFilter: @[],
+    )
+    check rm.unwrapReceivedMessage(serializeMessage(ackMsg).get()).isOk()
+    check rm.getOutgoingBuffer(testChannel).len == 2
+
+    # The budget leaves one resend over, which keeps the sweep due
+    waitFor sleepAsync(chronos.milliseconds(60))
+    let delay = rm.tick()
+    var outgoing = rm.getOutgoingBuffer(testChannel)
+    check:
+      delay <= initDuration(milliseconds = 1)
+      outgoing[0].resendAttempts == 1
+      outgoing[1].resendAttempts == 0
+
+    discard rm.tick()
+    outgoing = rm.getOutgoingBuffer(testChannel)
+    check:
+      outgoing[0].resendAttempts == 1
+      outgoing[1].resendAttempts == 1
+
+    rm.cleanup()
+
 # Special cases handling
 suite "Special Cases Handling":
   var rm: ReliabilityManager
@@ -575,6 +852,14 @@ suite "cleanup":
       outBuffer.len == 0
       history.len == 0
 
+type ThreadWrapArgs = tuple[rm: pointer, channelId: SdsChannelID, count: int]
+
+proc wrapFromThread(args: ThreadWrapArgs) {.thread.} =
+  # The manager is kept alive by the test, the thread only borrows it
+  let rm {.cursor.} = cast[ReliabilityManager](args.rm)
+  for i in 0 ..< args.count:
+    discard rm.wrapOutgoingMessage(@[byte(i)], args.channelId & "-" & $i, args.channelId)
+
 suite "Multi-Channel ReliabilityManager Tests":
   var rm: ReliabilityManager
 
@@ -741,3 +1026,475 @@ suite "Multi-Channel ReliabilityManager Tests":
     # Dependencies in channel1 should not affect channel2
     check rm.channels[channel1].bloomFilter.contains("dep1")
     check not rm.channels[channel2].bloomFilter.contains("dep1")
+
+  test "distinct channels are used from several threads":
+    const count = 200
+    var threads: array[2, Thread[ThreadWrapArgs]]
+    for i, channelId in ["thread-channel-0", "thread-channel-1"]:
+      createThread(threads[i], wrapFromThread, (cast[pointer](rm), channelId, count))
+    joinThreads(threads)
+
+    for channelId in ["thread-channel-0", "thread-channel-1"]:
+      let history = rm.getMessageHistory(channelId)
+      check:
+        history.len == count
+        history[^1] == channelId & "-" & $(count - 1)
+        rm.getOutgoingBuffer(channelId).len == count
+
+  test "callbacks may call back into their channel":
+    let channelId = "reentrant-channel"
+    var readyCount = 0
+    rm.setCallbacks(
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        readyCount += 1,
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc(messageId: SdsMessageID, deps: seq[HistoryEntry], channelId: SdsChannelID) {.gcsafe.} =
+        # Retrieved right away: the channel lock is no longer held
+        {.cast(gcsafe).}:
+          discard rm.markDependenciesMet(deps.getMessageIds(), channelId),
+    )
+
+    let msg = SdsMessage(
+      messageId: "late",
+      lamportTimestamp: 1,
+      causalHistory: toCausalHistory(@["missing"]),
+      channelId: channelId,
+      content: @[byte(1)],
+      bloomFilter: @[],
+    )
+    let unwrapped = rm.unwrapReceivedMessage(serializeMessage(msg).get())
+    check:
+      unwrapped.isOk()
+      readyCount == 1
+      rm.getMessageHistory(channelId) == @["late"]
+      rm.getIncomingBuffer(channelId).len == 0
+
+  test "retrieval hint providers may call back into their channel":
+    let channelId = "reentrant-hints"
+    var reentered = false
+    rm.setCallbacks(
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc(messageId: SdsMessageID, deps: seq[HistoryEntry], channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      nil,
+      proc(messageId: SdsMessageID): seq[byte] {.gcsafe.} =
+        # Called with no lock held
+        {.cast(gcsafe).}:
+          if not reentered:
+            reentered = true
+            discard rm.wrapOutgoingMessage(@[byte(2)], "from-provider", channelId)
+        cast[seq[byte]]("hint:" & messageId),
+    )
+
+    check rm.wrapOutgoingMessage(@[byte(1)], "first", channelId).isOk()
+    let wrapped = rm.wrapOutgoingMessage(@[byte(3)], "second", channelId)
+    check:
+      wrapped.isOk()
+      reentered
+      rm.getMessageHistory(channelId) == @["first", "from-provider", "second"]
+      deserializeMessage(wrapped.get()).get().causalHistory[0] ==
+        newHistoryEntry("first", cast[seq[byte]]("hint:first"))
+
+suite "Bloom filter serialization":
+  test "sparse encoding for a mostly empty filter":
+    var rbf = newRollingBloomFilter()
+    rbf.add("msg1")
+    let encoded = serializeBloomFilter(rbf.filter)
+    check encoded.isOk()
+    check encoded.get().len < 64
+
+    let decoded = deserializeBloomFilter(encoded.get())
+    check decoded.isOk()
+    check:
+      decoded.get().intArray == rbf.filter.intArray
+      decoded.get().mBits == rbf.filter.mBits
+      decoded.get().kHashes == rbf.filter.kHashes
+      decoded.get().lookup("msg1")
+
+  test "raw encoding for a well filled filter":
+    var bf = initializeBloomFilter(100, 0.01).get()
+    for i in 0 ..< 100:
+      bf.insert("msg" & $i)
+    let encoded = serializeBloomFilter(bf)
+    check encoded.isOk()
+    check encoded.get().len >= bf.intArray.len * sizeof(int)
+
+    let decoded = deserializeBloomFilter(encoded.get())
+    check decoded.isOk()
+    check decoded.get().intArray == bf.intArray
+
+  test "filter views probe the serialized bits in place":
+    for kind in [BloomFilterKind.Standard, BloomFilterKind.Blocked]:
+      var bf = initializeBloomFilter(100, 0.01, kind = kind).get()
+      for nItems in [1, 100]: # sparse, then raw encoding
+        for i in 0 ..< nItems:
+          bf.insert("msg" & $i)
+        let encoded = serializeBloomFilter(bf).get()
+        let view = decodeBloomFilterView(encoded)
+        check view.isOk()
+        check view.get().encoding ==
+          (if nItems == 1: BloomFilterEncoding.Sparse else: BloomFilterEncoding.Raw)
+
+        for i in 0 ..< 200:
+          let digest = bloomDigest("msg" & $i)
+          check view.get().lookup(digest) == bf.lookup(digest)
+
+    check decodeBloomFilterView(@[byte(1), 2, 3]).isErr()
+
+  test "hostile filter parameters are rejected":
+    var bf = initializeBloomFilter(100, 0.01).get()
+    bf.insert("msg")
+    for kHashes in [0, MaxHashes + 1, 1 shl 62]:
+      var hostile = bf
+      hostile.kHashes = kHashes
+      let encoded = serializeBloomFilter(hostile).get()
+      check:
+        deserializeBloomFilter(encoded).isErr()
+        decodeBloomFilterView(encoded).isErr()
+
+    # A filter without hash functions would ack every outgoing message
+    let rm = newReliabilityManager().get()
+    check rm.wrapOutgoingMessage(@[byte(1)], "unacked", testChannel).isOk()
+    var ackAll = bf
+    ackAll.kHashes = 0
+    let msg = SdsMessage(
+      messageId: "hostile",
+      lamportTimestamp: 1,
+      channelId: testChannel,
+      content: @[byte(2)],
+      bloomFilter: serializeBloomFilter(ackAll).get(),
+    )
+    check:
+      rm.unwrapReceivedMessage(serializeMessage(msg).get()).isOk()
+      rm.getOutgoingBuffer(testChannel).len == 1
+    rm.cleanup()
+
+  test "wrapped messages reuse cached segments":
+    let rm = newReliabilityManager().get()
+
+    for i in 0 .. 2:
+      let wrapped = rm.wrapOutgoingMessage(@[byte(i)], "cached" & $i, testChannel)
+      check wrapped.isOk()
+      # Splicing the cached segments produces the same bytes as a full encode
+      let decoded = deserializeMessage(wrapped.get())
+      check decoded.isOk()
+      check serializeMessage(decoded.get()).get() == wrapped.get()
+      check decoded.get().causalHistory.len == i
+
+    let channel = rm.channels[testChannel]
+    check:
+      # the window slid over the last wrapped message
+      channel.messageHistory.causalWindow() ==
+        encodeCausalHistory(toCausalHistory(@["cached0", "cached1", "cached2"]))
+
+    rm.cleanup()
+
+  test "the serialized bloom filter is patched in place":
+    var config = defaultConfig()
+    config.bloomFilterCapacity = 100 # raw bits after a few dozen IDs
+    let rm = newReliabilityManager(config).get()
+
+    for i in 0 ..< 40:
+      check rm.wrapOutgoingMessage(@[byte(i)], "patched" & $i, testChannel).isOk()
+    let channel = rm.channels[testChannel]
+    check:
+      channel.bloomFilterRawStart >= 0
+      channel.bloomFilterBytes.len > 0 # still current after the last insert
+      channel.bloomFilterBytes == serializeBloomFilter(channel.bloomFilter.filter).get()
+
+    # A received message is patched in too, and the next wrap sends the bytes
+    # as they are
+    let received = SdsMessage(
+      messageId: "fromPeer",
+      lamportTimestamp: 1,
+      causalHistory: @[],
+      channelId: testChannel,
+      content: @[byte(1)],
+      bloomFilter: @[],
+    )
+    check rm.unwrapReceivedMessage(serializeMessage(received).get()).isOk()
+    let expected = serializeBloomFilter(channel.bloomFilter.filter).get()
+    check channel.bloomFilterBytes == expected
+
+    let wrapped = rm.wrapOutgoingMessage(@[byte(1)], "patched40", testChannel)
+    check:
+      wrapped.isOk()
+      deserializeMessage(wrapped.get()).get().bloomFilter == expected
+
+    rm.cleanup()
+
+  test "messages encode into caller buffers at their exact size":
+    let msg = SdsMessage(
+      messageId: "sized",
+      lamportTimestamp: 300,
+      causalHistory: toCausalHistory(@["dep1", "dep2"]) &
+        @[HistoryEntry(messageId: "dep3", retrievalHint: @[byte(1), 2, 3])],
+      channelId: testChannel,
+      content: newSeq[byte](200),
+      bloomFilter: @[byte(7)],
+    )
+    let expected = encode(msg).buffer
+    check:
+      msg.encodedSize() == expected.len
+      serializeMessage(msg).get() == expected
+
+    var output = newSeq[byte](expected.len + 8)
+    check:
+      msg.encodeInto(output).get() == expected.len
+      output[0 ..< expected.len] == expected
+      msg.encodeInto(output.toOpenArray(0, expected.len - 2)).isErr()
+
+    let rm = newReliabilityManager().get()
+    var wrapped = newSeqOfCap[byte](1024)
+    check rm.wrapOutgoingMessage(@[byte(1)], "reused", testChannel, wrapped).isOk()
+    check:
+      deserializeMessage(wrapped).get().messageId == "reused"
+      wrapped.capacity >= 1024 # the buffer was reused, not replaced
+
+    var asString: string
+    check rm.wrapOutgoingMessage(@[byte(1)], "as-string", testChannel, asString).isOk()
+    check deserializeMessage(@(asString.toOpenArrayByte(0, asString.high))).get().messageId ==
+      "as-string"
+
+    var allocated = AllocatedBuffer(
+      alloc: proc(size: int): pointer {.nimcall, gcsafe, raises: [].} =
+        allocShared(size),
+      release: proc(data: pointer) {.nimcall, gcsafe, raises: [].} =
+        deallocShared(data),
+    )
+    check rm.wrapOutgoingMessage(@[byte(2)], "allocated", testChannel, allocated).isOk()
+    check:
+      allocated.len > 0
+      deserializeMessage(@(allocated.data.toOpenArray(0, allocated.len - 1))).get().messageId ==
+        "allocated"
+    allocated.free()
+    check allocated.data.isNil()
+
+    # A failed wrap leaves neither output nor an unacknowledged message behind
+    var exhausted = AllocatedBuffer(
+      alloc: proc(size: int): pointer {.nimcall, gcsafe, raises: [].} =
+        nil,
+      release: proc(data: pointer) {.nimcall, gcsafe, raises: [].} =
+        deallocShared(data),
+    )
+    let buffered = rm.getOutgoingBuffer(testChannel).len
+    check:
+      rm.wrapOutgoingMessage(@[byte(3)], "exhausted", testChannel, exhausted).error ==
+        ReliabilityError.reOutOfMemory
+      exhausted.data.isNil()
+      exhausted.len == 0
+      rm.getOutgoingBuffer(testChannel).len == buffered
+      "exhausted" notin rm.getMessageHistory(testChannel)
+    rm.cleanup()
+
+suite "Rolling bloom filter":
+  test "old generations expire without losing recent IDs":
+    var rbf = newRollingBloomFilter(100, 0.001)
+    check rbf.maxCapacity == 120
+
+    for i in 0 ..< 200:
+      rbf.add("rolling" & $i)
+
+    # At least the last maxCapacity div 2 IDs are always remembered
+    for i in 140 ..< 200:
+      check rbf.contains("rolling" & $i)
+
+    var expired = 0
+    for i in 0 ..< 50:
+      if not rbf.contains("rolling" & $i):
+        expired.inc()
+    check expired >= 45
+
+  test "a full union stays under the target error rate":
+    for kind in [BloomFilterKind.Standard, BloomFilterKind.Blocked]:
+      var rbf = newRollingBloomFilter(1000, 0.01, kind)
+      # Right before the next rotation both generations are full
+      for i in 0 ..< rbf.maxCapacity div 2 * 3:
+        rbf.add("member" & $i)
+      check rbf.isFull()
+
+      var falsePositives = 0
+      let fpTestSize = 200_000
+      for i in 0 ..< fpTestSize:
+        if rbf.contains("absent" & $i):
+          falsePositives.inc()
+      let fpRate = falsePositives.float / fpTestSize.float
+      check fpRate < 0.01 * 1.2 # 20% tolerance for the sampling noise
+
+suite "Message history":
+  test "ring evicts the oldest IDs and keeps the index in sync":
+    var history = initMessageHistory(3)
+    for msgId in ["a", "b", "a", "c", "d"]:
+      history.add(msgId)
+
+    var ids: seq[SdsMessageID]
+    for msgId in history:
+      ids.add(msgId)
+    check:
+      history.len == 3
+      ids == @["a", "c", "d"]
+      history[0] == "a"
+      history[^1] == "d"
+      "a" in history # the second "a" is still in the ring
+      "b" notin history
+
+    history.add("e")
+    check:
+      "a" notin history
+      "e" in history
+
+    var recentIds: seq[SdsMessageID]
+    for msgId in history.recent(2):
+      recentIds.add(msgId)
+    check recentIds == @["d", "e"]
+
+    history.clear()
+    check:
+      history.len == 0
+      "e" notin history
+
+  test "the encoded window slides with the history":
+    var history = initMessageHistory(4, windowSize = 2)
+    for msgId in ["a", "b", "c"]:
+      history.add(msgId)
+    check history.causalWindow() == encodeCausalHistory(toCausalHistory(@["b", "c"]))
+
+    # Hints learnt inside the window are encoded into it, those outside are not
+    check:
+      history.setRetrievalHint("c", @[byte(1)])
+      history.setRetrievalHint("a", @[byte(2)])
+      not history.setRetrievalHint("c", @[byte(3)]) # already known
+      history.causalWindow() ==
+        encodeCausalHistory(@[newHistoryEntry("b"), newHistoryEntry("c", @[byte(1)])])
+
+    for msgId in ["d", "e", "f"]:
+      history.add(msgId)
+    check:
+      history.windowIds() == @["e", "f"]
+      history.causalWindow() == encodeCausalHistory(toCausalHistory(@["e", "f"]))
+
+suite "Sharded ReliabilityManager":
+  test "batches are routed per channel and keep their order":
+    let sender = newShardedReliabilityManager(4).get()
+    let receiver = newShardedReliabilityManager(4).get()
+
+    let channels = @["alpha", "beta", "gamma", "delta", "epsilon"]
+    var requests: seq[WrapRequest] = @[]
+    for i in 0 ..< 50:
+      let channelId = channels[i mod channels.len]
+      requests.add((@[byte(i)], channelId & "-" & $i, channelId))
+
+    let wrapped = sender.wrapOutgoingMessages(requests)
+    check wrapped.len == requests.len
+
+    var messages: seq[seq[byte]] = @[]
+    for res in wrapped:
+      check res.isOk()
+      messages.add(res.get())
+
+    let unwrapped = receiver.unwrapReceivedMessages(messages & @[@[byte(0xFF)]])
+    check:
+      unwrapped.len == messages.len + 1
+      unwrapped[^1].isErr()
+
+    for i in 0 ..< messages.len:
+      check unwrapped[i].isOk()
+      let (content, missingDeps, channelId) = unwrapped[i].get()
+      check:
+        content == requests[i].message
+        channelId == requests[i].channelId
+        missingDeps.len == 0 # Earlier messages of the channel were unwrapped first
+
+    for channelId in channels:
+      let shard = sender.shardFor(channelId)
+      check:
+        shard.getOutgoingBuffer(channelId).len == 10
+        receiver.shardFor(channelId).getMessageHistory(channelId).len == 10
+
+    sender.cleanup()
+    receiver.cleanup()
+
+suite "Message views":
+  test "view borrows the fields of a serialized message":
+    let msg = SdsMessage(
+      messageId: "view-msg",
+      lamportTimestamp: 42,
+      causalHistory: @[newHistoryEntry("dep1", @[byte(7), 8]), newHistoryEntry("dep2")],
+      channelId: testChannel,
+      content: @[byte(1), 2, 3],
+      bloomFilter: @[byte(9)],
+    )
+    let serialized = serializeMessage(msg).get()
+
+    let view = SdsMessageView.decode(serialized).get()
+    check:
+      view.messageId == "view-msg"
+      view.channelId == testChannel
+      view.lamportTimestamp == 42
+      view.historyLen == 2
+      view.content == msg.content
+      view.toMessage() == deserializeMessage(serialized).get()
+
+    var depIds: seq[SdsMessageID] = @[]
+    for entry in view.history:
+      depIds.add(view.toString(entry.messageId))
+    check depIds == @["dep1", "dep2"]
+
+    check:
+      SdsMessageView.decode(serialized[0 ..< serialized.len - 1]).isErr()
+      SdsMessageView.decode(newSeq[byte]()).isErr()
+      extractChannelId(serialized).get() == testChannel
+
+  test "lamport timestamps above high(int64) are decoded, not rejected":
+    # The varint is 2^64 - 1 on the wire
+    let serialized = serializeMessage(
+      SdsMessage(
+        messageId: "wrapped-timestamp",
+        lamportTimestamp: -1,
+        channelId: testChannel,
+        content: @[byte(1)],
+      )
+    ).get()
+    check:
+      SdsMessageView.decode(serialized).get().lamportTimestamp == -1
+      deserializeMessage(serialized).get().lamportTimestamp == -1
+
+    let rm = newReliabilityManager().get()
+    check rm.unwrapReceivedMessage(serialized).isOk()
+    rm.cleanup()
+
+  test "history entries are validated after the duplicate check":
+    let rm = newReliabilityManager().get()
+    var readyCount = 0
+    rm.setCallbacks(
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        readyCount += 1,
+      proc(messageId: SdsMessageID, channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+      proc(messageId: SdsMessageID, missingDeps: seq[HistoryEntry], channelId: SdsChannelID) {.gcsafe.} =
+        discard,
+    )
+
+    let msg = SdsMessage(
+      messageId: "dup", lamportTimestamp: 1, channelId: testChannel, content: @[byte(1)]
+    )
+    let serialized = serializeMessage(msg).get()
+    # Same message with a history entry lacking its message ID (field 3, empty)
+    let malformed = serialized & @[byte(0x1A), 0x00]
+
+    check:
+      rm.unwrapReceivedMessage(malformed).isErr()
+      rm.unwrapReceivedMessage(serialized).isOk()
+      readyCount == 1
+
+    let dup = rm.unwrapReceivedMessage(malformed)
+    check:
+      dup.isOk() # Dropped as a duplicate before its history was looked at
+      dup.get().message == @[byte(1)]
+      readyCount == 1
+
+    rm.cleanup()
@@ -0,0 +1,71 @@
+import unittest
+import library/sds_thread/inter_thread_communication/request_queue
+
+const
+  QueueCapacity = 64
+  Producers = 4
+  PerProducer = 20_000
+
+type
+  TestQueue = RequestQueue[int, QueueCapacity]
+  ProducerArgs = tuple[queue: ptr TestQueue, producer: int]
+
+proc produce(args: ProducerArgs) {.thread.} =
+  # Values carry their producer and their rank, retried while the queue is full
+  for i in 0 ..< PerProducer:
+    while not args.queue[].trySend(args.producer * PerProducer + i):
+      cpuRelax()
+
+suite "Request queue":
+  test "full and empty queues are reported":
+    var queue = createShared(TestQueue)
+    queue[].init()
+
+    var value: int
+    check not queue[].tryRecv(value)
+    for i in 0 ..< QueueCapacity:
+      check queue[].trySend(i)
+    check not queue[].trySend(QueueCapacity)
+
+    check:
+      queue[].tryRecv(value)
+      value == 0
+      queue[].trySend(QueueCapacity) # a cell was freed
+
+    for i in 1 .. QueueCapacity:
+      check:
+        queue[].tryRecv(value)
+        value == i
+    check not queue[].tryRecv(value)
+    freeShared(queue)
+
+  test "concurrent producers keep their own order":
+    var queue = createShared(TestQueue)
+    queue[].init()
+
+    var threads: array[Producers, Thread[ProducerArgs]]
+    for p in 0 ..< Producers:
+      createThread(threads[p], produce, (queue, p))
+
+    var
+      next: array[Producers, int]
+      received = 0
+      outOfOrder = 0
+      value: int
+    while received < Producers * PerProducer:
+      if not queue[].tryRecv(value):
+        cpuRelax()
+        continue
+      let producer = value div PerProducer
+      if value mod PerProducer != next[producer]:
+        inc outOfOrder
+      next[producer] = value mod PerProducer + 1
+      inc received
+
+    joinThreads(threads)
+    check:
+      outOfOrder == 0
+      not queue[].tryRecv(value)
+    for p in 0 ..< Producers:
+      check next[p] == PerProducer
+    freeShared(queue)